@@ -11,6 +11,10 @@ echo "Querying (Ori)"
 ./u_query -l label/0_ori -q query/0_q.txt -a answer/0_ori.txt -g graph/0.txt -t n -u n
 echo ""
 
+echo "Querying (Ori, mapped)"
+./u_query -l label/0_ori -q query/0_q.txt -a answer/0_map.txt -g graph/0.txt -t m -u n -c y
+echo ""
+
 echo "Inc Updating"
 ./u_update -l label/0_ori -n label/0_inc -u update/0_inc.txt -i info/0_inc.txt
 echo ""
@@ -26,3 +30,7 @@ echo ""
 echo "Querying (Dec Updated)"
 ./u_query -l label/0_dec -q query/0_q.txt -a answer/0_dec.txt -g graph/0.txt -t y -u update/0_dec.txt
 echo ""
+
+echo "Querying (Dec Updated, mapped)"
+./u_query -l label/0_dec -q query/0_q.txt -a answer/0_dec_map.txt -g graph/0.txt -t m -u update/0_dec.txt -c y
+echo ""
@@ -0,0 +1,19 @@
+#! /bin/bash -e
+make
+echo "^^^^Compile completed^^^^"
+echo " "
+echo "Graph 1 Indexing (file order)"
+./u_index -g graph/1.txt -l label/1_ori -o file -r graph/1_order.txt -f info/1_ori.txt
+echo ""
+echo "Bridge Updating"
+./u_update -l label/1_ori -n label/1_cut -u update/1_cut.txt -i info/1_cut.txt
+echo ""
+echo "Graph 1 Rebuilding (updated graph, same order)"
+./u_index -g graph/1_cut.txt -l label/1_ref -o file -r graph/1_order.txt -f info/1_ref.txt
+echo ""
+echo "Comparing the whole index"
+if cmp label/1_cut.q label/1_ref.q; then
+    echo "updated index equals the rebuilt one"
+else
+    exit 1
+fi
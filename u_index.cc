@@ -26,11 +26,17 @@ int main(int argc, char** argv) {
   std::string lfilename;
   std::string ifilename;
   std::string osname;
+  std::string rfilename; // order file of -o file
+  uint32_t num_threads = 1;
+  uint32_t num_samples = 256; // BFS sources of -o betweenness
+  uint32_t tree_width = 0; // core-tree elimination bound, 0 for a flat index
+  bool fold = false; // fold degree-1 trees and twins before labelling
+  bool compress = false; // compressed labels in label_file.q
   spc::USPCIndex::OrderScheme os = spc::USPCIndex::OrderScheme::kInvalid;
 
   {
     int option = -1;
-    while (-1 != (option = getopt(argc, argv, "g:l:o:f:i:"))) { //s:e:i:
+    while (-1 != (option = getopt(argc, argv, "g:l:o:f:i:t:r:k:w:e:z:"))) { //s:e:i:
       switch (option) {
         case 'g':
           gfilename = optarg; break;
@@ -38,10 +44,30 @@ int main(int argc, char** argv) {
           lfilename = optarg; break;
         case 'f': // info
           ifilename = optarg; break;
+        case 't': // threads
+          num_threads = std::max(1, atoi(optarg)); break;
+        case 'r': // order file
+          rfilename = optarg; break;
+        case 'k': // betweenness samples
+          num_samples = std::max(1, atoi(optarg)); break;
+        case 'w': // core-tree width
+          tree_width = std::max(0, atoi(optarg)); break;
+        case 'e': // fold
+          fold = ReadBool(optarg[0]); break;
+        case 'z': // compressed query index
+          compress = ReadBool(optarg[0]); break;
         case 'o': // ordering
           osname = optarg;
           if ("degree" == osname) {
             os = spc::USPCIndex::OrderScheme::kDegree;
+          } else if ("betweenness" == osname) {
+            os = spc::USPCIndex::OrderScheme::kBetweenness;
+          } else if ("core" == osname) {
+            os = spc::USPCIndex::OrderScheme::kCore;
+          } else if ("hybrid" == osname) {
+            os = spc::USPCIndex::OrderScheme::kHybrid;
+          } else if ("file" == osname) {
+            os = spc::USPCIndex::OrderScheme::kFile;
           } else {
             os = spc::USPCIndex::OrderScheme::kInvalid;
           }
@@ -51,6 +77,10 @@ int main(int argc, char** argv) {
     printf("graph file: %s\n", gfilename.c_str());
     printf("label file: %s\n", lfilename.c_str());
     printf("ordering: %s\n", osname.c_str());
+    printf("threads: %" PRIu32 "\n", num_threads);
+    printf("tree width: %" PRIu32 "\n", tree_width);
+    printf("fold: %c\n", fold? 'y' : 'n');
+    printf("compress: %c\n", compress? 'y' : 'n');
   }
 
   // read the graph
@@ -63,6 +93,12 @@ int main(int argc, char** argv) {
   // build index
   spc::USPCIndex spc;
   spc.set_os(os);
+  spc.set_threads(num_threads);
+  spc.set_samples(num_samples);
+  spc.set_order_file(rfilename);
+  spc.set_tree_width(tree_width);
+  spc.set_fold(fold);
+  spc.set_compress(compress);
 
   spc.BuildIndex(graph);
 
@@ -72,10 +108,15 @@ int main(int argc, char** argv) {
          std::chrono::duration<double, std::milli>(dif).count());
   
   auto label_num = spc.IndexWrite(lfilename);
+  spc.QueryIndexWrite(lfilename + ".q");
 
 
   std::ofstream ifile;
   ifile.open(ifilename.c_str());
   ifile << "Index time: " << std::chrono::duration<double, std::milli>(dif).count() << std::endl 
-  << "Index Num: " << label_num << std::endl;
+  << "Index Num: " << label_num << std::endl
+  << "Index Order: " << osname << std::endl
+  << "Index Threads: " << num_threads << std::endl
+  << "Index Tree: " << spc.num_tree() << " (width " << tree_width << ")" << std::endl
+  << "Index Labelled: " << spc.num_labelled() << std::endl;
 }
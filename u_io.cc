@@ -39,3 +39,21 @@ void GraphRead(const std::string& filename,
   }
   fclose(gfile);
 }
+
+void GraphComponents(const spc::Graph& graph, std::vector<uint32_t>& comp) {
+  const uint32_t n = graph.size();
+  comp.assign(n, UINT32_MAX);
+  std::vector<uint32_t> queue;
+  for (uint32_t r = 0; r < n; ++r) {
+    if (UINT32_MAX != comp[r]) continue;
+    comp[r] = r;
+    queue.assign(1, r);
+    for (size_t head = 0; head < queue.size(); ++head) {
+      for (const uint32_t w : graph[queue[head]]) {
+        if (UINT32_MAX != comp[w]) continue;
+        comp[w] = r;
+        queue.push_back(w);
+      }
+    }
+  }
+}
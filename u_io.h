@@ -2,10 +2,14 @@
 #define U_IO_H_
 
 #include <string>
+#include <vector>
 
 #include "u_label.h"
 
 void GraphRead(const std::string& filename, spc::Graph& graph,
                uint32_t& n, uint32_t& m);
 
+// comp[v] is the smallest vertex in the connected component of v
+void GraphComponents(const spc::Graph& graph, std::vector<uint32_t>& comp);
+
 #endif
@@ -1,6 +1,7 @@
 #ifndef SPC_U_LABEL_H_
 #define SPC_U_LABEL_H_
 
+#include <algorithm>
 #include <cstdint>
 #include <string>
 #include <vector>
@@ -11,51 +12,131 @@ namespace spc {
 using uint32_t = std::uint32_t;
 using uint64_t = std::uint64_t;
 
-uint32_t constexpr kNumVBits = 25; //23
-uint32_t constexpr kNumDBits = 10; //10
-uint32_t constexpr kNumCBits = 29; //31
-uint32_t constexpr kUBC = (static_cast<uint32_t>(1) << kNumCBits) - 1;
+// label entry layouts: an entry holds a hub rank v, a distance d and a
+// shortest path count c saturated at kUBC. The layout is picked at compile
+// time with -DSPC_LABEL_LAYOUT (make LAYOUT=...), so every kernel is built
+// for one layout only, and is recorded in the query index header:
+//   0  narrow, 32-bit word, 16/6/10 bits: < 65,536 vertices, distance < 64
+//   1  default, 64-bit word, 25/10/29 bits
+//   2  wide, three 32-bit words: < 2^32 vertices, count < 2^32
+// The wide layout widens hub ranks, not counts: every layout keeps counts
+// within 32 bits so that one product of two counts fits 64 bits. The sums
+// in Count are not saturated, so near-saturated counts over several common
+// hubs can still wrap 2^64.
+#ifndef SPC_LABEL_LAYOUT
+#define SPC_LABEL_LAYOUT 1
+#endif
+
+// v, d and c packed high to low into one word
+template <typename Word, uint32_t VBits, uint32_t DBits, uint32_t CBits>
+struct PackedLayout {
+  static_assert(VBits + DBits + CBits == 8 * sizeof(Word), "bits fill the word");
+  static constexpr uint32_t kVBits = VBits;
+  static constexpr uint32_t kDBits = DBits;
+  static constexpr uint32_t kCBits = CBits;
+
+  struct Entry {
+    Word v_d_c;
+  };
 
-struct LabelEntry final {
-  uint64_t v_d_c;
+  // each field is masked to its bits, so a value too large for its field
+  // cannot spill into the others
+  static Entry Merge(const uint32_t v, const uint32_t d, const uint32_t c) {
+    return {static_cast<Word>(((static_cast<Word>(v) & Mask(VBits)) << (DBits + CBits)) |
+                              ((static_cast<Word>(d) & Mask(DBits)) << CBits) |
+                              (static_cast<Word>(c) & Mask(CBits)))};
+  }
+  static uint32_t V(const Entry& e) {
+    return static_cast<uint32_t>(e.v_d_c >> (DBits + CBits));
+  }
+  static uint32_t D(const Entry& e) {
+    return static_cast<uint32_t>(e.v_d_c >> CBits) & ((static_cast<uint32_t>(1) << DBits) - 1);
+  }
+  static uint32_t C(const Entry& e) {
+    return static_cast<uint32_t>(e.v_d_c) & ((static_cast<uint32_t>(1) << CBits) - 1);
+  }
+  // same hub and distance, count 0
+  static Entry ZeroC(const Entry& e) {
+    return {static_cast<Word>(e.v_d_c & ~Mask(CBits))};
+  }
+
+ private:
+  static constexpr Word Mask(const uint32_t bits) {
+    return static_cast<Word>((static_cast<Word>(1) << bits) - 1);
+  }
 };
 
+struct WideLayout {
+  static constexpr uint32_t kVBits = 32;
+  static constexpr uint32_t kDBits = 32;
+  static constexpr uint32_t kCBits = 32;
+
+  struct Entry {
+    uint32_t v, d, c;
+  };
+
+  static Entry Merge(const uint32_t v, const uint32_t d, const uint32_t c) {
+    return {v, d, c};
+  }
+  static uint32_t V(const Entry& e) { return e.v; }
+  static uint32_t D(const Entry& e) { return e.d; }
+  static uint32_t C(const Entry& e) { return e.c; }
+  static Entry ZeroC(const Entry& e) { return {e.v, e.d, 0}; }
+};
+
+#if SPC_LABEL_LAYOUT == 0
+using Layout = PackedLayout<uint32_t, 16, 6, 10>;
+#elif SPC_LABEL_LAYOUT == 1
+using Layout = PackedLayout<uint64_t, 25, 10, 29>;
+#elif SPC_LABEL_LAYOUT == 2
+using Layout = WideLayout;
+#else
+#error "SPC_LABEL_LAYOUT is 0 (narrow), 1 (default) or 2 (wide)"
+#endif
+
+uint32_t constexpr kNumVBits = Layout::kVBits;
+uint32_t constexpr kNumDBits = Layout::kDBits;
+uint32_t constexpr kNumCBits = Layout::kCBits;
+uint32_t constexpr kUBC = static_cast<uint32_t>((static_cast<uint64_t>(1) << kNumCBits) - 1);
+
+using LabelEntry = Layout::Entry;
+
+// counts above kUBC are saturated; the update paths and the expansion of
+// core-tree and folded labels pass sums and products of counts here
 inline LabelEntry LEMerge(const uint32_t v,
                           const uint32_t d,
-                          const uint32_t c) {
-  return {(((static_cast<uint64_t>(v) << kNumDBits) | (d)) << kNumCBits) | (c)};
+                          const uint64_t c) {
+  return Layout::Merge(v, d, static_cast<uint32_t>(std::min<uint64_t>(c, kUBC)));
 }
 
 inline uint32_t LEExtractV(const LabelEntry& le) {
-  return static_cast<uint32_t>(le.v_d_c >> (kNumDBits + kNumCBits));
+  return Layout::V(le);
 }
 
 inline uint32_t LEExtractD(const LabelEntry& le) {
-  uint32_t mask = (static_cast<uint32_t>(1) << kNumDBits) - 1;
-  return static_cast<uint32_t>((le.v_d_c >> kNumCBits) & mask);
+  return Layout::D(le);
 }
 
 inline uint32_t LEExtractC(const LabelEntry& le) {
-  uint32_t mask = (static_cast<uint32_t>(1) << kNumCBits) - 1;
-  return static_cast<uint32_t>(le.v_d_c & mask);
+  return Layout::C(le);
 }
 
 inline void NormalV(const uint32_t v) {
-  if (v >= (static_cast<uint32_t>(1) << kNumVBits)) {
+  if (v >= (static_cast<uint64_t>(1) << kNumVBits)) {
     std::string msg = "too many vertices: " + std::to_string(v);
     ASSERT_INFO(false, msg.c_str());
   }
 }
 
 inline void NormalD(const uint32_t d) {
-  if (d >= (static_cast<uint32_t>(1) << kNumDBits)) {
+  if (d >= (static_cast<uint64_t>(1) << kNumDBits)) {
     std::string msg = "large distance: " + std::to_string(d);
     ASSERT_INFO(false, msg.c_str());
   }
 }
 
 inline void NormalC(const uint32_t c) {
-  if (c >= (static_cast<uint32_t>(1) << kNumCBits)) {
+  if (c >= (static_cast<uint64_t>(1) << kNumCBits)) {
     std::string msg = "large count: " + std::to_string(c);
     ASSERT_INFO(false, msg.c_str());
   }
@@ -63,6 +144,348 @@ inline void NormalC(const uint32_t c) {
 
 using Graph = std::vector<std::vector<uint32_t>>;
 using Label = std::vector<std::vector<LabelEntry>>;
+
+// dynamic label of USPCUpdate, kept as a packed-memory array: the entries
+// stay in rank order with free slots (gaps) spread between them, so an
+// insertion only shifts entries up to a nearby gap and a deletion leaves a
+// gap behind. When the segment around an insertion is too dense, the
+// smallest enclosing window under its density threshold is re-spread.
+// A gap is a copy of the entry before it with count 0, so merges can run
+// over the raw slots unchanged: a gap is always met after the entry it
+// copies and adds nothing to a count. Slot 0 is never a gap.
+class GappedLabel {
+ public:
+  // # of slots, including gaps
+  size_t size() const { return slots_.size(); }
+  // # of real entries
+  size_t num_entries() const { return num_; }
+
+  const LabelEntry& operator[](const size_t i) const { return slots_[i]; }
+  std::vector<LabelEntry>::const_iterator begin() const {
+    return slots_.begin();
+  }
+  std::vector<LabelEntry>::const_iterator end() const { return slots_.end(); }
+
+  bool IsGap(const size_t i) const {
+    return i > 0 && LEExtractV(slots_[i]) == LEExtractV(slots_[i - 1]);
+  }
+
+  // rank-sorted entries, stored without gaps
+  void Assign(std::vector<LabelEntry> entries) {
+    slots_ = std::move(entries);
+    num_ = slots_.size();
+  }
+
+  // real entries in rank order
+  std::vector<LabelEntry> Entries() const {
+    std::vector<LabelEntry> entries;
+    entries.reserve(num_);
+    for (size_t i = 0; i < slots_.size(); ++i) {
+      if (!IsGap(i)) entries.push_back(slots_[i]);
+    }
+    return entries;
+  }
+
+  // overwrite the entry at slot i with an entry of the same hub
+  void Set(const size_t i, const LabelEntry e) {
+    slots_[i] = e;
+    Refill(i + 1, LEExtractV(e), e);
+  }
+
+  // insert e right before the entry at slot pos (pos == size() appends)
+  void Insert(const size_t pos, const LabelEntry e) {
+    ++num_;
+    const size_t n = slots_.size();
+    if (pos > 0 && IsGap(pos - 1)) {
+      const uint32_t old = LEExtractV(slots_[pos - 1]);
+      slots_[pos - 1] = e;
+      Refill(pos, old, e);
+      return;
+    }
+    if (pos == n) {
+      slots_.push_back(e);
+      return;
+    }
+    // nearest gap in the leaf segment of pos
+    const size_t ls = pos / kLeaf * kLeaf;
+    const size_t le = std::min(ls + kLeaf, n);
+    for (size_t g = pos + 1; g < le; ++g) {
+      if (!IsGap(g)) continue;
+      const uint32_t old = LEExtractV(slots_[g]);
+      std::move_backward(slots_.begin() + pos, slots_.begin() + g,
+                         slots_.begin() + g + 1);
+      slots_[pos] = e;
+      Refill(g + 1, old, slots_[g]);
+      return;
+    }
+    for (size_t g = pos; g > ls + 1; --g) {
+      if (!IsGap(g - 2)) continue;
+      std::move(slots_.begin() + g - 1, slots_.begin() + pos,
+                slots_.begin() + g - 2);
+      slots_[pos - 1] = e;
+      return;
+    }
+    Rebalance(pos, e);
+  }
+
+  // remove the entry at slot pos
+  void Erase(const size_t pos) {
+    --num_;
+    if (0 == num_) {
+      std::vector<LabelEntry>().swap(slots_);
+      return;
+    }
+    const uint32_t v = LEExtractV(slots_[pos]);
+    if (0 == pos) {
+      // keep slot 0 real: pull the next entry forward
+      size_t q = 1;
+      while (LEExtractV(slots_[q]) == v) ++q;
+      slots_[0] = slots_[q];
+      for (size_t k = 1; k <= q; ++k) slots_[k] = Gap(slots_[0]);
+    } else {
+      Refill(pos, v, slots_[pos - 1]);
+    }
+    if (slots_.size() > 2 * kLeaf && num_ * 4 < slots_.size()) {
+      Spread(0, slots_.size(), 2 * num_, slots_.size(), nullptr);
+    }
+  }
+
+ private:
+  static constexpr size_t kLeaf = 16;
+
+  static LabelEntry Gap(const LabelEntry e) { return Layout::ZeroC(e); }
+
+  // slots from i on that copied hub "old" now copy entry e
+  void Refill(size_t i, const uint32_t old, const LabelEntry e) {
+    for (; i < slots_.size() && LEExtractV(slots_[i]) == old; ++i) {
+      slots_[i] = Gap(e);
+    }
+  }
+
+  // find the smallest window around pos whose density stays under its
+  // threshold (1 at the leaves down to 3/4 at the root) and re-spread it
+  // with e; grow to density 1/2 if even the root is too dense
+  void Rebalance(const size_t pos, const LabelEntry e) {
+    const size_t n = slots_.size();
+    uint32_t height = 1;
+    while ((kLeaf << height) < n) ++height;
+    for (uint32_t l = 1; l <= height; ++l) {
+      const size_t w = kLeaf << l;
+      const size_t ws = pos / w * w;
+      const size_t we = std::min(ws + w, n);
+      size_t cnt = 1;
+      for (size_t i = ws; i < we; ++i) cnt += !IsGap(i);
+      if (4 * height * cnt <= (4 * height - l) * (we - ws)) {
+        Spread(ws, we, we - ws, pos, &e);
+        return;
+      }
+    }
+    Spread(0, n, std::max(2 * num_, kLeaf), pos, &e);
+  }
+
+  // re-spread the entries of [ws, we) (plus e before slot pos, if any)
+  // evenly over cap slots starting at ws; cap != we - ws only for the
+  // whole label
+  void Spread(const size_t ws, const size_t we, const size_t cap,
+              const size_t pos, const LabelEntry* e) {
+    std::vector<LabelEntry> buf;
+    buf.reserve(we - ws + 1);
+    for (size_t i = ws; i < we; ++i) {
+      if (i == pos) buf.push_back(*e);
+      if (!IsGap(i)) buf.push_back(slots_[i]);
+    }
+    const uint32_t old = LEExtractV(slots_[we - 1]);
+    if (cap != we - ws) slots_.resize(cap);
+    const size_t m = buf.size();
+    for (size_t k = 0, j = 0; k < cap; ++k) {
+      if (j < m && k == j * cap / m) slots_[ws + k] = buf[j++];
+      else slots_[ws + k] = Gap(buf[j - 1]);
+    }
+    Refill(ws + cap, old, buf[m - 1]);
+  }
+
+  std::vector<LabelEntry> slots_;
+  size_t num_ = 0;
+};
+
+// read-only label store in one contiguous array: the entries of vertex v are
+// entries[offsets[v]], ..., entries[offsets[v + 1] - 1]. The hub field is
+// also split out into hubs[] so merge kernels can load hub ranks only; the
+// copy costs 4 more bytes per entry (half again the 64-bit layout), in
+// memory and in label_file.q.
+struct FlatLabel {
+  std::vector<uint64_t> offsets;
+  std::vector<LabelEntry> entries;
+  std::vector<uint32_t> hubs;
+
+  void BuildHubs() {
+    hubs.resize(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) hubs[i] = LEExtractV(entries[i]);
+  }
+
+  const LabelEntry* begin(const uint32_t v) const {
+    return entries.data() + offsets[v];
+  }
+  const LabelEntry* end(const uint32_t v) const {
+    return entries.data() + offsets[v + 1];
+  }
+  size_t size(const uint32_t v) const {
+    return offsets[v + 1] - offsets[v];
+  }
+  size_t bytes() const {
+    return offsets.capacity() * sizeof(uint64_t) +
+           entries.capacity() * sizeof(LabelEntry) +
+           hubs.capacity() * sizeof(uint32_t);
+  }
+};
+
+// FlatLabel layout over memory owned elsewhere: a FlatLabel or the sections
+// of a mapped query index file
+struct FlatLabelView {
+  const uint64_t* offsets = nullptr;
+  const LabelEntry* entries = nullptr;
+  const uint32_t* hubs = nullptr;
+
+  FlatLabelView() = default;
+  explicit FlatLabelView(const FlatLabel& fl)
+      : offsets(fl.offsets.data()), entries(fl.entries.data()),
+        hubs(fl.hubs.data()) {}
+
+  const LabelEntry* begin(const uint32_t v) const {
+    return entries + offsets[v];
+  }
+  const LabelEntry* end(const uint32_t v) const {
+    return entries + offsets[v + 1];
+  }
+  size_t size(const uint32_t v) const {
+    return offsets[v + 1] - offsets[v];
+  }
+};
+
+// compressed label store: the label of v is bytes[offsets[v]] up to
+// bytes[offsets[v + 1]], a run of blocks of up to kBlock entries. A block
+// is varint(last hub - base) and varint(body bytes), then its entries as
+// varint(hub - previous hub), varint(d), varint(c). Hubs are taken minus 1
+// relative to the previous one (base is the last hub of the block before,
+// -1 for the first), so a hub rank costs one byte while the gap is < 129.
+// The block header lets a merge skip a whole block whose last hub is below
+// the hub it looks for.
+struct CompressedLabel {
+  static constexpr uint32_t kBlock = 16;
+
+  std::vector<uint64_t> offsets{0};
+  std::vector<uint8_t> bytes;
+
+  // append the label of the next vertex, entries in rank order
+  void Append(const LabelEntry* b, const LabelEntry* e) {
+    uint32_t base = UINT32_MAX;
+    uint8_t body[kBlock * 15];
+    for (; b < e; b += std::min<size_t>(kBlock, e - b)) {
+      const LabelEntry* const be = b + std::min<size_t>(kBlock, e - b);
+      uint8_t* q = body;
+      uint32_t prev = base;
+      for (const LabelEntry* p = b; p < be; ++p) {
+        q = PutVarint(q, LEExtractV(*p) - prev - 1);
+        q = PutVarint(q, LEExtractD(*p));
+        q = PutVarint(q, LEExtractC(*p));
+        prev = LEExtractV(*p);
+      }
+      uint8_t head[10];
+      uint8_t* h = PutVarint(head, prev - base - 1);
+      h = PutVarint(h, static_cast<uint32_t>(q - body));
+      bytes.insert(bytes.end(), head, h);
+      bytes.insert(bytes.end(), body, q);
+      base = prev;
+    }
+    offsets.push_back(bytes.size());
+  }
+
+  size_t bytes_used() const {
+    return offsets.capacity() * sizeof(uint64_t) + bytes.capacity();
+  }
+
+  static uint8_t* PutVarint(uint8_t* q, uint32_t x) {
+    while (x >= 0x80) {
+      *q++ = static_cast<uint8_t>(x | 0x80);
+      x >>= 7;
+    }
+    *q++ = static_cast<uint8_t>(x);
+    return q;
+  }
+  static const uint8_t* GetVarint(const uint8_t* p, uint32_t& x) {
+    if (likely(*p < 0x80)) {
+      x = *p;
+      return p + 1;
+    }
+    x = *p & 0x7F;
+    for (uint32_t s = 7; *p++ & 0x80; s += 7) x |= static_cast<uint32_t>(*p & 0x7F) << s;
+    return p;
+  }
+};
+
+// CompressedLabel over memory owned elsewhere
+struct CompressedLabelView {
+  const uint64_t* offsets = nullptr;
+  const uint8_t* bytes = nullptr;
+
+  CompressedLabelView() = default;
+  explicit CompressedLabelView(const CompressedLabel& cl)
+      : offsets(cl.offsets.data()), bytes(cl.bytes.data()) {}
+};
+
+// decodes one compressed label entry by entry
+class CompressedCursor {
+ public:
+  uint32_t v = 0, d = 0, c = 0; // the current entry
+
+  CompressedCursor(const CompressedLabelView& cl, const uint32_t r)
+      : p_(cl.bytes + cl.offsets[r]), end_(cl.bytes + cl.offsets[r + 1]) {}
+
+  // move to the next entry; false past the last one
+  bool Next() {
+    if (p_ == block_end_) {
+      if (p_ == end_) return false;
+      Enter();
+    }
+    Decode();
+    return true;
+  }
+
+  // move to the first entry with hub >= h, skipping whole blocks below it;
+  // false if there is none. The current entry must be below h
+  bool Seek(const uint32_t h) {
+    while (last_ < h) {
+      p_ = block_end_;
+      if (p_ == end_) return false;
+      Enter();
+    }
+    do Decode(); while (v < h);
+    return true;
+  }
+
+ private:
+  // read the block header at p_
+  void Enter() {
+    uint32_t x, len;
+    v = last_;
+    p_ = CompressedLabel::GetVarint(p_, x);
+    last_ += x + 1;
+    p_ = CompressedLabel::GetVarint(p_, len);
+    block_end_ = p_ + len;
+  }
+  void Decode() {
+    uint32_t x;
+    p_ = CompressedLabel::GetVarint(p_, x);
+    v += x + 1;
+    p_ = CompressedLabel::GetVarint(p_, d);
+    p_ = CompressedLabel::GetVarint(p_, c);
+  }
+
+  const uint8_t* p_;
+  const uint8_t* end_;
+  const uint8_t* block_end_ = p_;
+  uint32_t last_ = UINT32_MAX; // last hub of the current block
+};
 } // namespace spc
 
 #endif
@@ -1,4 +1,5 @@
 #include <unistd.h>
+#include <algorithm>
 #include <chrono>
 #include <cinttypes>
 #include <cstdint>
@@ -27,8 +28,13 @@ int main(int argc, char** argv) {
     std::string gfilename; // graph file
     std::string ufilename; // update edges; graph should be gfile + ufile
     std::string index_Tag; // index flag
+    std::string kernel_Tag = "auto"; // count kernel
+    char verify = 'n'; // checksum of a mapped index
+    uint32_t batch = 0; // queries per CountBatch call, 0 for one Count per query
+    int threads = 1; // query threads
+    char compress = 'n'; // decode compressed labels in Count
     int option = -1;
-    while (-1 != (option = getopt(argc, argv, "l:a:q:g:t:u:"))) {
+    while (-1 != (option = getopt(argc, argv, "l:a:q:g:t:u:k:c:b:p:z:"))) {
         switch (option) {
             case 'l':
                 lfilename = optarg; break;
@@ -42,21 +48,54 @@ int main(int argc, char** argv) {
                 ufilename = optarg; break;
             case 't':
                 index_Tag = optarg; break;
+            case 'k':
+                kernel_Tag = optarg; break;
+            case 'c':
+                verify = optarg[0]; break;
+            case 'b':
+                batch = std::max(0, atoi(optarg)); break;
+            case 'p':
+                threads = std::max(1, atoi(optarg)); break;
+            case 'z':
+                compress = optarg[0]; break;
         }
     }
 
     printf("label file: %s\n", lfilename.c_str());
     printf("graph file: %s\n", gfilename.c_str());
     printf("update file (if any): %s\n", ufilename.c_str());
+    printf("threads: %d\n", threads);
     printf("answer file: %s\n", afilename.c_str());
 
     // read index
     spc::USPCQuery uspc;
     spc::USPCBasic uspb;
+    if (kernel_Tag == "scalar")
+        uspc.set_kernel(spc::USPCQuery::KernelScheme::kScalar);
+    else if (kernel_Tag == "avx2")
+        uspc.set_kernel(spc::USPCQuery::KernelScheme::kAVX2);
+    else if (kernel_Tag == "avx512")
+        uspc.set_kernel(spc::USPCQuery::KernelScheme::kAVX512);
+    else
+        uspc.set_kernel(spc::USPCQuery::KernelScheme::kAuto);
+    const auto beg_load = std::chrono::steady_clock::now();
     if (index_Tag == "n")
         uspc.IndexRead(lfilename); // cL_ and dL_ are read separatly and then merged, used for querying with an original index
+    else if (index_Tag == "m")
+        uspc.IndexMap(lfilename + ".q"); // query-ready index written next to the label file, used in place
     else
         uspc.IndexRead_UPD(lfilename); // cL_ and dL_ are merged before, used for querying with an updated index
+    printf("index load costs \033[47;31m%f ms\033[0m\n",
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - beg_load).count());
+    if (index_Tag == "m" && verify == 'y') {
+        ASSERT_INFO(uspc.IndexVerify(), "query index checksum mismatch");
+    }
+    if (compress == 'y' && !uspc.compressed()) {
+        const uint64_t flat_bytes = uspc.label_bytes();
+        uspc.Compress();
+        printf("compressed labels:\t%.2f MB -> %.2f MB (%.2fx)\n", flat_bytes / 1048576.0,
+            uspc.label_bytes() / 1048576.0, static_cast<double>(flat_bytes) / uspc.label_bytes());
+    }
 
     // read queries
     FILE* file = fopen(qfilename.c_str(), "r");
@@ -102,65 +141,97 @@ int main(int argc, char** argv) {
             fclose(file_u);
         }
 
-        // BFS answer quering
+        // BFS answer quering, one workspace per thread
         std::string bfsafilename = afilename.substr(0,7) + "bibfs_" + afilename.substr(7,afilename.size()-7);
         std::ofstream bfsafile;
         bfsafile.open(bfsafilename.c_str());
         auto btotal = std::chrono::steady_clock::now() - std::chrono::steady_clock::now();
+        results_bfs.resize(queries.size());
+        std::vector<decltype(btotal)> btimes(queries.size());
+        std::vector<spc::BiBFSWorkspace> bws(threads);
+        for (auto& ws : bws) ws.Init(graph.size());
+        std::vector<uint32_t> comp; // pairs in different components have no path
+        GraphComponents(graph, comp);
 
         progressbar bar(queries.size());
-        for (int i = 0; i < queries.size(); ++i) {
-            auto query = queries[i];
-            bar.update();
-            const uint32_t v1 = query.first;
-            const uint32_t v2 = query.second;
-            std::pair<uint32_t, uint64_t> result;
+        const auto beg_all = std::chrono::steady_clock::now();
+        #pragma omp parallel for schedule(dynamic, 64) num_threads(threads)
+        for (size_t i = 0; i < queries.size(); ++i) {
+            if (1 == threads) bar.update();
+            const uint32_t v1 = queries[i].first;
+            const uint32_t v2 = queries[i].second;
 
             const auto beg_bfs = std::chrono::steady_clock::now();
 
-            result = uspc.bi_BFS_Count(graph, v1, v2);
+            if (comp[v1] != comp[v2])
+                results_bfs[i] = std::make_pair(0, 0);
+            else
+                results_bfs[i] = uspc.bi_BFS_Count(graph, v1, v2, bws[omp_get_thread_num()]);
 
             const auto end_bfs = std::chrono::steady_clock::now();
-            const auto dif_bfs = end_bfs - beg_bfs;
-            
-            btotal += dif_bfs;
+            btimes[i] = end_bfs - beg_bfs;
+        }
+        const auto bwall = std::chrono::steady_clock::now() - beg_all;
 
-            bfsafile << v1 << "\t" << v2 << "\t" << result.first << "\t" << result.second << "\t" 
-            << std::chrono::duration<double, std::micro>(dif_bfs).count() << "\n";
-            results_bfs.push_back(result);
+        // answers in input order
+        for (size_t i = 0; i < queries.size(); ++i) {
+            btotal += btimes[i];
+            bfsafile << queries[i].first << "\t" << queries[i].second << "\t" << results_bfs[i].first << "\t"
+            << results_bfs[i].second << "\t" << std::chrono::duration<double, std::micro>(btimes[i]).count() << "\n";
         }
         bfsafile.close();
 
         printf("\nBFS costs \033[47;31m%f microseconds\033[0m in average\n",
             std::chrono::duration<double, std::micro>(btotal).count() / num_queries);
+        if (threads > 1)
+            printf("BFS throughput: %.0f queries/s\n",
+                num_queries / std::chrono::duration<double>(bwall).count());
     }
 
     // Compute the results by hub labeling
     printf("Hub Labeling Querying:\n");
-    std::vector<std::pair<uint32_t, uint64_t>> results;
+    std::vector<std::pair<uint32_t, uint64_t>> results(queries.size());
     std::ofstream afile;
     afile.open(afilename.c_str());
     auto qtotal = std::chrono::steady_clock::now() - std::chrono::steady_clock::now();
+    std::vector<decltype(qtotal)> qtimes(queries.size());
+
+    // queries go out in chunks, each answered by one CountBatch call or one
+    // Count per query; the time of a batch is spread evenly over its queries
+    const size_t chunk = batch > 0 ? batch : (threads > 1 ? 1024 : 1);
+    const size_t num_chunks = (queries.size() + chunk - 1) / chunk;
+    progressbar bar(num_chunks);
+    const auto beg_all = std::chrono::steady_clock::now();
+    #pragma omp parallel for schedule(dynamic) num_threads(threads)
+    for (size_t c = 0; c < num_chunks; ++c) {
+        if (1 == threads) bar.update();
+        const size_t i = c * chunk;
+        const size_t num = std::min(chunk, queries.size() - i);
+        if (batch > 0) {
+            const auto beg = std::chrono::steady_clock::now();
+
+            uspc.CountBatch(queries.data() + i, num, results.data() + i);
+
+            const auto end = std::chrono::steady_clock::now();
+            for (size_t j = i; j < i + num; ++j) qtimes[j] = (end - beg) / num;
+        } else {
+            for (size_t j = i; j < i + num; ++j) {
+                const auto beg = std::chrono::steady_clock::now();
+
+                results[j] = uspc.Count(queries[j].first, queries[j].second);
+
+                const auto end = std::chrono::steady_clock::now();
+                qtimes[j] = end - beg;
+            }
+        }
+    }
+    const auto qwall = std::chrono::steady_clock::now() - beg_all;
 
-    progressbar bar(queries.size());
-    for (int i = 0; i < queries.size(); ++i) {
-        auto query = queries[i];
-        bar.update();
-        const uint32_t v1 = query.first;
-        const uint32_t v2 = query.second;
-        std::pair<uint32_t, uint64_t> result;
-
-        const auto beg = std::chrono::steady_clock::now();
-
-        result = uspc.Count(v1, v2);
-        
-        const auto end = std::chrono::steady_clock::now();
-        const auto dif = end - beg;
-        qtotal += dif;
-
-        afile << v1 << "\t" << v2 << "\t" << result.first << "\t" << result.second << "\t" 
-        << std::chrono::duration<double, std::micro>(dif).count() << "\n";
-        results.push_back(result);
+    // answers in input order
+    for (size_t i = 0; i < queries.size(); ++i) {
+        qtotal += qtimes[i];
+        afile << queries[i].first << "\t" << queries[i].second << "\t" << results[i].first << "\t"
+        << results[i].second << "\t" << std::chrono::duration<double, std::micro>(qtimes[i]).count() << "\n";
     }
 
     afile.close();
@@ -168,4 +239,7 @@ int main(int argc, char** argv) {
     ASSERT(results.size() == num_queries);
     printf("\nQuery costs \033[47;31m%f microseconds\033[0m in average\n",
                 std::chrono::duration<double, std::micro>(qtotal).count() / num_queries);
+    // with one thread, the summed query time leaves out the progressbar
+    printf("Throughput: %.0f queries/s\n",
+                num_queries / std::chrono::duration<double>(threads > 1 ? qwall : qtotal).count());
 }
@@ -0,0 +1,271 @@
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+#include "macros.h"
+#include "u_label.h"
+#include "u_spc.h"
+
+// Resident query/update server: the index is read once and kept in a
+// USPCUpdate. Every request is a fixed 9-byte frame
+//     op (1 byte) | v1 (uint32) | v2 (uint32)
+// answered by a fixed 13-byte frame
+//     status (1 byte) | d (uint32) | c (uint64)
+// in host byte order. Ops:
+//     'q'  count shortest paths between v1 and v2, answer (d, c)
+//     'i'  insert edge (v1, v2)
+//     'd'  delete edge (v1, v2)
+//     'a'  add a vertex, answer its id in d
+//     'r'  remove every edge of v1, which stays as an isolated vertex
+//     'h'  number of vertices whose labels hold v1 as a hub, in c (needs -v y)
+//     'w'  write the index (and its .q copy) to the -n file
+//     'x'  stop the server
+// For updates and 'w', c is the time taken in microseconds. Status is 0 on
+// success and 1 for a bad request (unknown op, vertex out of range, v1 == v2,
+// inserting an existing edge or deleting a missing one). v2 of 'h' and 'r'
+// and both vertices of 'a' are unused.
+// With a socket, each client is served by its own thread: queries read the
+// last published label snapshot without locking, while updates and writes
+// take turns on one writer lock and publish a new snapshot when done. At
+// most USPCUpdate::kMaxReaders clients are served at once; another one gets
+// a single status 1 reply and is closed.
+
+namespace {
+
+uint8_t constexpr kOK = 0;
+uint8_t constexpr kBad = 1;
+
+bool ReadFull(const int fd, char* buf, size_t len) {
+    while (len > 0) {
+        const ssize_t r = read(fd, buf, len);
+        if (r <= 0) return false;
+        buf += r; len -= r;
+    }
+    return true;
+}
+
+// false once the client is gone (EPIPE, as SIGPIPE is ignored); Serve then
+// drops the connection and the server keeps running
+bool WriteFull(const int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        const ssize_t w = write(fd, buf, len);
+        if (w < 0 && EINTR == errno) continue;
+        if (w <= 0) return false;
+        buf += w; len -= w;
+    }
+    return true;
+}
+
+bool Reply(const int fd, const uint8_t status, const uint32_t d, const uint64_t c) {
+    char buf[13];
+    buf[0] = static_cast<char>(status);
+    memcpy(buf + 1, &d, sizeof(d));
+    memcpy(buf + 5, &c, sizeof(c));
+    return WriteFull(fd, buf, sizeof(buf));
+}
+
+std::mutex writer;
+// vertices so far; grown by 'a' once the new vertex is published
+std::atomic<uint32_t> num_vertices{0};
+
+// serve one connection; returns false once a client asked to stop. reader
+// is the snapshot slot of the connection, or -1 to read the labels directly
+bool Serve(spc::USPCUpdate& uspu, const std::string& newlfilename,
+           const int in_fd, const int out_fd, const int reader) {
+    char buf[9];
+    while (ReadFull(in_fd, buf, sizeof(buf))) {
+        const char op = buf[0];
+        uint32_t v1, v2;
+        memcpy(&v1, buf + 1, sizeof(v1));
+        memcpy(&v2, buf + 5, sizeof(v2));
+        const uint32_t n = num_vertices.load();
+
+        if ('x' == op) {
+            Reply(out_fd, kOK, 0, 0);
+            return false;
+        }
+        if ('w' == op) {
+            std::lock_guard<std::mutex> lock(writer);
+            const auto beg = std::chrono::steady_clock::now();
+            bool ok = !newlfilename.empty();
+            if (ok) {
+                uspu.IndexWrite(newlfilename);
+                uspu.QueryIndexWrite(newlfilename + ".q");
+            }
+            const auto dif = std::chrono::steady_clock::now() - beg;
+            if (!Reply(out_fd, ok ? kOK : kBad, 0,
+                       std::chrono::duration_cast<std::chrono::microseconds>(dif).count())) break;
+            continue;
+        }
+        if ('h' == op) {
+            std::lock_guard<std::mutex> lock(writer);
+            const bool ok = uspu.inverted() && v1 < n;
+            if (!Reply(out_fd, ok ? kOK : kBad, 0, ok ? uspu.CoveredID(v1).size() : 0)) break;
+            continue;
+        }
+        if ('a' == op || 'r' == op) {
+            std::unique_lock<std::mutex> lock(writer);
+            if ('r' == op && v1 >= n) {
+                lock.unlock();
+                if (!Reply(out_fd, kBad, 0, 0)) break;
+                continue;
+            }
+            const auto beg = std::chrono::steady_clock::now();
+            uint32_t v = 0;
+            if ('a' == op) v = uspu.AddVertex();
+            else uspu.RemoveVertex(v1);
+            if (reader >= 0) uspu.Publish();
+            num_vertices.store(uspu.num_vertices());
+            const auto dif = std::chrono::steady_clock::now() - beg;
+            lock.unlock();
+            if (!Reply(out_fd, kOK, v,
+                       std::chrono::duration_cast<std::chrono::microseconds>(dif).count())) break;
+            continue;
+        }
+        if (('q' != op && 'i' != op && 'd' != op) || v1 >= n || v2 >= n || v1 == v2) {
+            if (!Reply(out_fd, kBad, 0, 0)) break;
+            continue;
+        }
+        if ('q' == op) {
+            const auto res = reader < 0 ? uspu.CountID(v1, v2) : uspu.SnapshotCount(reader, v1, v2);
+            if (!Reply(out_fd, kOK, res.first, res.second)) break;
+            continue;
+        }
+
+        // updates
+        std::unique_lock<std::mutex> lock(writer);
+        const bool exists = uspu.HasEdge(v1, v2);
+        if (('i' == op) == exists) {
+            lock.unlock();
+            if (!Reply(out_fd, kBad, 0, 0)) break;
+            continue;
+        }
+        const auto beg = std::chrono::steady_clock::now();
+        if ('i' == op) uspu.Inc_SPC(v1, v2);
+        else uspu.Dec_SPC(v1, v2);
+        if (reader >= 0) uspu.Publish();
+        const auto dif = std::chrono::steady_clock::now() - beg;
+        lock.unlock();
+        if (!Reply(out_fd, kOK, 0,
+                   std::chrono::duration_cast<std::chrono::microseconds>(dif).count())) break;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::string lfilename; // label file
+    std::string newlfilename; // where 'w' writes the updated index
+    std::string sfilename; // unix socket; stdin/stdout if not given
+    char inverted = 'n'; // keep the hub -> vertices index for 'h'
+    int option = -1;
+    while (-1 != (option = getopt(argc, argv, "l:n:s:v:"))) {
+        switch (option) {
+            case 'l':
+                lfilename = optarg; break;
+            case 'n':
+                newlfilename = optarg; break;
+            case 's':
+                sfilename = optarg; break;
+            case 'v':
+                inverted = optarg[0]; break;
+        }
+    }
+
+    // a reply to a client that hung up must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // in pipe mode the frames own stdout, so log lines go to stderr
+    int out_fd = STDOUT_FILENO;
+    if (sfilename.empty()) {
+        out_fd = dup(STDOUT_FILENO);
+        ASSERT(out_fd >= 0 && dup2(STDERR_FILENO, STDOUT_FILENO) >= 0);
+    }
+
+    printf("label file: %s\n", lfilename.c_str());
+    printf("new label file: %s\n", newlfilename.c_str());
+    printf("socket: %s\n", sfilename.empty() ? "stdin/stdout" : sfilename.c_str());
+
+    // read index
+    spc::USPCUpdate uspu;
+    uspu.IndexRead(lfilename);
+    if (inverted == 'y') uspu.EnableInverted();
+    num_vertices.store(uspu.num_vertices());
+    fflush(stdout);
+
+    if (sfilename.empty()) {
+        Serve(uspu, newlfilename, STDIN_FILENO, out_fd, -1);
+        return 0;
+    }
+    uspu.EnableSnapshots();
+
+    const int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT(sfd >= 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    ASSERT_INFO(sfilename.size() < sizeof(addr.sun_path), "socket path too long");
+    strcpy(addr.sun_path, sfilename.c_str());
+    unlink(sfilename.c_str());
+    ASSERT(0 == bind(sfd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)));
+    ASSERT(0 == listen(sfd, 16));
+    std::cout << "listening." << std::endl;
+
+    // a thread per client; a stop request shuts the listening socket and
+    // every open connection, and the labels outlive all client threads
+    std::atomic<bool> running{true};
+    std::mutex clients_mutex;
+    std::set<int> clients;
+    while (running.load()) {
+        const int cfd = accept(sfd, nullptr, nullptr);
+        if (cfd < 0) continue;
+        // every snapshot slot is taken: refuse the client with one status 1
+        // reply instead of starting a thread it cannot read from
+        const uint32_t reader = uspu.AddReader();
+        if (spc::USPCUpdate::kNoReader == reader) {
+            Reply(cfd, kBad, 0, 0);
+            close(cfd);
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            clients.insert(cfd);
+        }
+        std::thread([&, cfd, reader]() {
+            if (!Serve(uspu, newlfilename, cfd, cfd, reader)) {
+                running.store(false);
+                shutdown(sfd, SHUT_RDWR);
+                std::lock_guard<std::mutex> lock(clients_mutex);
+                for (const int fd : clients) shutdown(fd, SHUT_RDWR);
+            }
+            uspu.RemoveReader(reader);
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            clients.erase(cfd);
+            close(cfd);
+        }).detach();
+    }
+    for (bool open = true; open; ) {
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            open = !clients.empty();
+        }
+        if (open) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    close(sfd);
+    unlink(sfilename.c_str());
+}
@@ -10,9 +10,11 @@
 #include <memory>
 #include <numeric>
 #include <queue>
+#include <random>
 #include <tuple>
 #include <set>
 #include <map>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include <string>
@@ -20,6 +22,11 @@
 #include <unistd.h>
 #include <iomanip>
 #include <omp.h>
+#include <immintrin.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstring>
 
 #include "progressbar.h"
 #include "macros.h"
@@ -61,6 +68,168 @@ std::pair<uint32_t, uint64_t> USPCBasic::BFS_SPC(const Graph& const_graph, uint3
 
 
 
+/*
+*******************
+*** Query index ***
+*******************
+*/
+
+namespace {
+
+constexpr uint32_t kEntryBits = kNumVBits | (kNumDBits << 8) | (kNumCBits << 16);
+
+void LabelFileHeaderWrite(FILE* file, const uint32_t num_tree) {
+	const LabelFileHeader h = {LabelFileHeader::kMagic, kEntryBits, num_tree};
+	ASSERT(fwrite(&h, sizeof(h), 1, file) == 1);
+}
+
+LabelFileHeader LabelFileHeaderRead(FILE* file) {
+	ASSERT_INFO(nullptr != file, "cannot open the label file");
+	LabelFileHeader h;
+	ASSERT_INFO(fread(&h, sizeof(h), 1, file) == 1 && LabelFileHeader::kMagic == h.magic,
+				"not a label file");
+	ASSERT_INFO(kEntryBits == h.entry_bits, "label entry layout differs from this build");
+	return h;
+}
+
+// 64-bit hash of a vertex list (splitmix64 steps)
+uint64_t HashList(const std::vector<uint32_t>& list) {
+	uint64_t h = list.size();
+	for (const uint32_t w : list) {
+		h = (h ^ w) + 0x9E3779B97F4A7C15ULL;
+		h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+		h ^= h >> 31;
+	}
+	return h;
+}
+
+uint64_t AlignUp(const uint64_t pos) {
+	const uint64_t a = QueryIndexHeader::kAlign;
+	return (pos + a - 1) / a * a;
+}
+
+// FNV-1a over 32-bit words; every section is a multiple of 4 bytes
+struct Checksum {
+	uint64_t h = 14695981039346656037ULL;
+	void Add(const void* data, const size_t bytes) {
+		const uint32_t* w = static_cast<const uint32_t*>(data);
+		for (size_t i = 0; i < bytes / sizeof(uint32_t); ++i) {
+			h = (h ^ w[i]) * 1099511628211ULL;
+		}
+	}
+};
+
+void WriteSum(FILE* file, const void* data, const size_t bytes,
+			  uint64_t& pos, Checksum& sum) {
+	ASSERT(fwrite(data, 1, bytes, file) == bytes);
+	sum.Add(data, bytes);
+	pos += bytes;
+}
+
+// zero fill up to the start of the next section
+void PadTo(FILE* file, const uint64_t to, uint64_t& pos, Checksum& sum) {
+	static const char zeros[QueryIndexHeader::kAlign] = {};
+	ASSERT(to >= pos && to - pos <= sizeof(zeros));
+	WriteSum(file, zeros, to - pos, pos, sum);
+}
+
+} // namespace
+
+uint64_t USPC::QueryIndexWrite(const std::string& filename,
+		const std::function<size_t(uint32_t)>& size,
+		const std::function<void(uint32_t, std::vector<LabelEntry>&)>& label) const {
+	ASSERT(0 != n_);
+	QueryIndexHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, QueryIndexHeader::kMagic, sizeof(h.magic));
+	h.version = QueryIndexHeader::kVersion;
+	h.entry_bits = kEntryBits;
+	h.n = n_;
+	h.num_tree = num_tree_;
+	for (uint32_t r = 0; r < n_; ++r) h.num_entries += size(r);
+	h.order_pos = AlignUp(sizeof(h));
+	h.rank_pos = AlignUp(h.order_pos + sizeof(uint32_t) * n_);
+	h.offsets_pos = AlignUp(h.rank_pos + sizeof(uint32_t) * n_);
+	std::vector<LabelEntry> L;
+	CompressedLabel cl;
+	if (compress_) {
+		ASSERT_INFO(0 == num_tree_ && fold_.empty(), "only flat indexes are compressed");
+		for (uint32_t r = 0; r < n_; ++r) {
+			label(r, L);
+			cl.Append(L.data(), L.data() + L.size());
+		}
+		// whole 32-bit words for the checksum
+		cl.bytes.resize((cl.bytes.size() + 3) / 4 * 4, 0);
+		h.zlabels_pos = AlignUp(h.offsets_pos + sizeof(uint64_t) * (n_ + 1));
+		h.file_bytes = AlignUp(h.zlabels_pos + cl.bytes.size());
+	} else {
+		h.entries_pos = AlignUp(h.offsets_pos + sizeof(uint64_t) * (n_ + 1));
+		h.hubs_pos = AlignUp(h.entries_pos + sizeof(LabelEntry) * h.num_entries);
+		h.file_bytes = AlignUp(h.hubs_pos + sizeof(uint32_t) * h.num_entries);
+	}
+	if (!fold_.empty()) {
+		h.fold_pos = h.file_bytes;
+		h.file_bytes = AlignUp(h.fold_pos + sizeof(FoldEntry) * n_);
+	}
+
+	FILE* file = fopen(filename.c_str(), "wb");
+	ASSERT(nullptr != file);
+	// the header is written again with the checksum at the end
+	ASSERT(fwrite(&h, sizeof(h), 1, file) == 1);
+	uint64_t pos = sizeof(h);
+	Checksum sum;
+
+	PadTo(file, h.order_pos, pos, sum);
+	WriteSum(file, order_.data(), sizeof(uint32_t) * n_, pos, sum);
+	PadTo(file, h.rank_pos, pos, sum);
+	WriteSum(file, rank_.data(), sizeof(uint32_t) * n_, pos, sum);
+
+	PadTo(file, h.offsets_pos, pos, sum);
+	if (compress_) {
+		WriteSum(file, cl.offsets.data(), sizeof(uint64_t) * (n_ + 1), pos, sum);
+		PadTo(file, h.zlabels_pos, pos, sum);
+		WriteSum(file, cl.bytes.data(), cl.bytes.size(), pos, sum);
+	} else {
+		uint64_t offset = 0;
+		WriteSum(file, &offset, sizeof(offset), pos, sum);
+		for (uint32_t r = 0; r < n_; ++r) {
+			offset += size(r);
+			WriteSum(file, &offset, sizeof(offset), pos, sum);
+		}
+
+		PadTo(file, h.entries_pos, pos, sum);
+		for (uint32_t r = 0; r < n_; ++r) {
+			label(r, L);
+			ASSERT(L.size() == size(r));
+			WriteSum(file, L.data(), sizeof(LabelEntry) * L.size(), pos, sum);
+		}
+
+		// second pass for the hub ranks, so no label is held twice
+		std::vector<uint32_t> H;
+		PadTo(file, h.hubs_pos, pos, sum);
+		for (uint32_t r = 0; r < n_; ++r) {
+			label(r, L);
+			H.resize(L.size());
+			for (size_t i = 0; i < L.size(); ++i) H[i] = LEExtractV(L[i]);
+			WriteSum(file, H.data(), sizeof(uint32_t) * H.size(), pos, sum);
+		}
+	}
+	if (!fold_.empty()) {
+		PadTo(file, h.fold_pos, pos, sum);
+		WriteSum(file, fold_.data(), sizeof(FoldEntry) * n_, pos, sum);
+	}
+	PadTo(file, h.file_bytes, pos, sum);
+
+	h.checksum = sum.h;
+	ASSERT(0 == fseek(file, 0, SEEK_SET));
+	ASSERT(fwrite(&h, sizeof(h), 1, file) == 1);
+	fclose(file);
+	return h.num_entries;
+}
+
+
+
 /*
 *******************
 ****** Index ******
@@ -82,7 +251,58 @@ void USPCIndex::BuildIndex(const Graph& const_graph) {
 
 	// ordering
 	(this->*of_[os_])(G_);
+	ASSERT_INFO(!fold_graph_ || 0 == tree_width_, "folding and the core-tree index do not combine");
+	ASSERT_INFO(!compress_ || (!fold_graph_ && 0 == tree_width_), "only flat indexes are compressed");
+	std::vector<Bag> bags;
+	if (tree_width_ > 0) Eliminate(bags);
+	if (fold_graph_) Fold();
 	OrderRank();
+
+	// rank space: from here on vertex r is order_[r], so label entries store
+	// hub ranks and merges compare them directly
+	{
+		Graph RG(n_);
+		for (uint32_t v = 0; v < n_; ++v) {
+			RG[rank_[v]].reserve(G_[v].size());
+			for (const uint32_t w : G_[v]) RG[rank_[v]].push_back(rank_[w]);
+			std::sort(RG[rank_[v]].begin(), RG[rank_[v]].end());
+		}
+		G_.swap(RG);
+	}
+
+	if (num_tree_ > 0) {
+		std::vector<Bag> RB(n_);
+		for (uint32_t v = 0; v < n_; ++v) {
+			for (const auto& e : bags[v]) {
+				RB[rank_[v]].emplace_back(rank_[std::get<0>(e)], std::get<1>(e), std::get<2>(e));
+			}
+			std::sort(RB[rank_[v]].begin(), RB[rank_[v]].end());
+		}
+		BuildCoreTree(RB);
+		return;
+	}
+
+	// a folded index runs its BFSs on the kernel, the representatives joined
+	// through their twins; the whole graph is put back for IndexWrite
+	Graph full;
+	if (!fold_.empty()) {
+		full = G_;
+		for (uint32_t r = 0; r < n_; ++r) {
+			G_[r].clear();
+			if (fold_[r].rep != r) continue;
+			for (const uint32_t w : full[r]) {
+				if (0 == fold_[w].depth && fold_[w].rep != r) G_[r].push_back(fold_[w].rep);
+			}
+			std::sort(G_[r].begin(), G_[r].end());
+			G_[r].erase(std::unique(G_[r].begin(), G_[r].end()), G_[r].end());
+		}
+	}
+
+	if (num_threads_ > 1) {
+		BuildIndexParallel();
+		if (!fold_.empty()) G_.swap(full);
+		return;
+	}
 	
 	// some auxiliary structures
 	std::vector<uint32_t> dLu(n_, UINT32_MAX);
@@ -93,7 +313,8 @@ void USPCIndex::BuildIndex(const Graph& const_graph) {
 
 	for (size_t i = 0; i < n_; ++i) {
 	bar.update();
-	const uint32_t u = order_[i];
+	const uint32_t u = i;
+	if (!fold_.empty() && fold_[u].rep != u) continue;
 
 	// for fast distance computation
 	for (const auto e : dL_[u]) dLu[LEExtractV(e)] = LEExtractD(e);
@@ -115,15 +336,16 @@ void USPCIndex::BuildIndex(const Graph& const_graph) {
 
 		// correct C[v]
 		if (unlikely(kUBC <= C[v])) C[v] = kUBC;
+		const uint32_t cv = v == u? C[v] : Through(v, C[v]);
 		for (const uint32_t w : G_[v]) {
-			if (rank_[w] <= rank_[u]) continue;
+			if (w <= u) continue;
 			if (UINT32_MAX == D[w]) {
 				D[w] = D[v] + 1;
-				C[w] = C[v];
+				C[w] = cv;
 				Q.push(w);
 				reset.push_back(w);
 			} else if (D[w] == D[v] + 1) {
-				if (likely(kUBC - C[v] >= C[w])) C[w] += C[v];
+				if (likely(kUBC - cv >= C[w])) C[w] += cv;
 				else C[w] = kUBC;
 			}
 		}
@@ -136,10 +358,396 @@ void USPCIndex::BuildIndex(const Graph& const_graph) {
 
 	for (const auto e : dL_[u]) dLu[LEExtractV(e)] = UINT32_MAX;
 
+	}
+	if (!fold_.empty()) G_.swap(full);
+}
+
+
+// parallel construction: hubs are taken in batches of consecutive ranks and the
+// pruned BFSs of one batch run concurrently. A hub only prunes against the
+// labels of earlier batches, so the entries it produces are buffered and
+// appended in rank order after the batch. Pruning less only adds entries
+// whose distance is not the shortest one, which never contribute to Count.
+// Batch sizes grow 1, 2, 4, ... up to num_threads_ so that the top hubs,
+// which prune the most, are still added almost sequentially. The labels
+// depend on num_threads_ only, not on scheduling.
+void USPCIndex::BuildIndexParallel() {
+	const uint32_t T = num_threads_;
+
+	// per-thread auxiliary structures
+	std::vector<std::vector<uint32_t>> dLu(T, std::vector<uint32_t>(n_, UINT32_MAX));
+	std::vector<std::vector<uint32_t>> D(T, std::vector<uint32_t>(n_, UINT32_MAX));
+	std::vector<std::vector<uint32_t>> C(T, std::vector<uint32_t>(n_, 0));
+	// (vertex, entry, canonical) produced by each hub of the batch
+	std::vector<std::vector<std::tuple<uint32_t, LabelEntry, bool>>> buf(T);
+
+	progressbar bar(n_);
+
+	uint32_t batch = 1;
+	for (size_t beg = 0; beg < n_; beg += batch, batch = std::min(batch * 2, T)) {
+	const size_t end = std::min<size_t>(beg + batch, n_);
+
+	#pragma omp parallel for num_threads(T) schedule(static, 1)
+	for (size_t i = beg; i < end; ++i) {
+		const uint32_t t = i - beg;
+		const uint32_t u = i;
+		if (!fold_.empty() && fold_[u].rep != u) continue;
+		auto& dLut = dLu[t]; auto& Dt = D[t]; auto& Ct = C[t];
+
+		for (const auto e : dL_[u]) dLut[LEExtractV(e)] = LEExtractD(e);
+
+		std::vector<uint32_t> reset({u});
+		std::queue<uint32_t> Q({u});
+		Dt[u] = 0; Ct[u] = 1;
+
+		while (!Q.empty()) {
+			const uint32_t v = Q.front(); Q.pop();
+			const uint32_t dSoFar = Distance(dLut, dL_[v]);
+			if (Dt[v] > dSoFar) continue;
+
+			NormalD(Dt[v]); NormalC(Ct[v]);
+			buf[t].emplace_back(v, LEMerge(u, Dt[v], Ct[v]), Dt[v] < dSoFar);
+
+			if (unlikely(kUBC <= Ct[v])) Ct[v] = kUBC;
+			const uint32_t cv = v == u? Ct[v] : Through(v, Ct[v]);
+			for (const uint32_t w : G_[v]) {
+				if (w <= u) continue;
+				if (UINT32_MAX == Dt[w]) {
+					Dt[w] = Dt[v] + 1;
+					Ct[w] = cv;
+					Q.push(w);
+					reset.push_back(w);
+				} else if (Dt[w] == Dt[v] + 1) {
+					if (likely(kUBC - cv >= Ct[w])) Ct[w] += cv;
+					else Ct[w] = kUBC;
+				}
+			}
+		}
+
+		for (const uint32_t v : reset) {
+			Dt[v] = UINT32_MAX; Ct[v] = 0;
+		}
+		for (const auto e : dL_[u]) dLut[LEExtractV(e)] = UINT32_MAX;
+	}
+
+	// append in rank order to keep every label sorted
+	for (size_t i = beg; i < end; ++i) {
+		bar.update();
+		for (const auto& p : buf[i - beg]) {
+			(std::get<2>(p)? dL_ : cL_)[std::get<0>(p)].push_back(std::get<1>(p));
+		}
+		buf[i - beg].clear();
+	}
+
 	}
 }
 
 
+// Core-tree index: vertices of degree <= tree_width_ are eliminated, min
+// degree first, and their neighbours are joined by shortcuts that keep the
+// shortest distance through the eliminated vertices and its count. What is
+// left is the core; the eliminated vertices form a tree decomposition whose
+// bags are their neighbourhoods at elimination time.
+void USPCIndex::Eliminate(std::vector<Bag>& bags) {
+	// (distance, count) of the current edges
+	std::vector<std::map<uint32_t, std::pair<uint32_t, uint64_t>>> adj(n_);
+	for (uint32_t v = 0; v < n_; ++v) {
+		for (const uint32_t w : G_[v]) {
+			if (w != v) adj[v].emplace(w, std::make_pair(1, 1));
+		}
+	}
+
+	// lazy min-heap of (degree, vertex); stale items are skipped
+	using Item = std::pair<uint32_t, uint32_t>;
+	std::priority_queue<Item, std::vector<Item>, std::greater<Item>> Q;
+	for (uint32_t v = 0; v < n_; ++v) {
+		if (adj[v].size() <= tree_width_) Q.emplace(adj[v].size(), v);
+	}
+
+	bags.assign(n_, Bag());
+	std::vector<bool> eliminated(n_, false);
+	std::vector<uint32_t> tree; // in elimination order
+	while (!Q.empty()) {
+		const uint32_t v = Q.top().second;
+		const uint32_t deg = Q.top().first;
+		Q.pop();
+		if (eliminated[v] || adj[v].size() != deg) continue;
+		eliminated[v] = true;
+		tree.push_back(v);
+
+		Bag& bag = bags[v];
+		for (const auto& e : adj[v]) {
+			bag.emplace_back(e.first, e.second.first, e.second.second);
+			adj[e.first].erase(v);
+		}
+		adj[v].clear();
+
+		// shortcuts between every two neighbours
+		for (size_t i = 0; i < bag.size(); ++i) {
+			for (size_t j = i + 1; j < bag.size(); ++j) {
+				const uint32_t x = std::get<0>(bag[i]), y = std::get<0>(bag[j]);
+				const uint32_t d = std::get<1>(bag[i]) + std::get<1>(bag[j]);
+				const uint64_t c = std::min<uint64_t>(std::get<2>(bag[i]) * std::get<2>(bag[j]), kUBC);
+				auto it = adj[x].find(y);
+				if (adj[x].end() == it || d < it->second.first) {
+					adj[x][y] = adj[y][x] = std::make_pair(d, c);
+				} else if (d == it->second.first) {
+					const uint64_t cc = std::min<uint64_t>(it->second.second + c, kUBC);
+					it->second.second = adj[y][x].second = cc;
+				}
+			}
+		}
+		for (const auto& e : bag) {
+			const uint32_t x = std::get<0>(e);
+			if (adj[x].size() <= tree_width_) Q.emplace(adj[x].size(), x);
+		}
+	}
+
+	// core edges
+	for (uint32_t v = 0; v < n_; ++v) {
+		if (eliminated[v]) continue;
+		for (const auto& e : adj[v]) bags[v].emplace_back(e.first, e.second.first, e.second.second);
+	}
+
+	// the core keeps its order on top, the vertex eliminated last follows
+	num_tree_ = tree.size();
+	auto core_end = std::stable_partition(order_.begin(), order_.end(),
+		[&eliminated](const uint32_t v) { return !eliminated[v]; });
+	std::reverse_copy(tree.begin(), tree.end(), core_end);
+	printf("core-tree: %" PRIu32 " core and %" PRIu32 " tree vertices\n", n_ - num_tree_, num_tree_);
+}
+
+// Core labels come from pruned Dijkstra searches on the contracted core
+// graph; they equal the labels of a flat index, since every tree vertex
+// ranks below the core. A tree vertex v gets, over the paths that leave it
+// through vertices eliminated before their end h:
+//   (h, d, c) for every tree vertex h on such a path with v, the bag
+//             ancestors of v and v itself (v, 0, 1)
+//   (a, d, c) for every core vertex a at the end of such a path
+// Both follow from the bags, as the labels of the bag vertices are done
+// when v is (they rank higher). USPCQuery::CountTree answers from these.
+void USPCIndex::BuildCoreTree(const std::vector<Bag>& bags) {
+	const uint32_t core = n_ - num_tree_;
+	std::vector<uint32_t> dLu(n_, UINT32_MAX);
+	std::vector<uint32_t> D(n_, UINT32_MAX);
+	std::vector<uint64_t> C(n_, 0);
+
+	progressbar bar(n_);
+
+	using Item = std::pair<uint32_t, uint32_t>;
+	std::priority_queue<Item, std::vector<Item>, std::greater<Item>> Q;
+	for (uint32_t u = 0; u < core; ++u) {
+	bar.update();
+
+	for (const auto e : dL_[u]) dLu[LEExtractV(e)] = LEExtractD(e);
+
+	std::vector<uint32_t> reset({u});
+	Q.emplace(0, u);
+	D[u] = 0; C[u] = 1;
+
+	while (!Q.empty()) {
+		const uint32_t v = Q.top().second;
+		const uint32_t dv = Q.top().first;
+		Q.pop();
+		if (dv > D[v]) continue;
+		const uint32_t dSoFar = Distance(dLu, dL_[v]);
+		if (D[v] > dSoFar) continue;
+
+		NormalD(D[v]);
+		(D[v] < dSoFar? dL_[v] : cL_[v]).push_back(LEMerge(u, D[v], C[v]));
+
+		for (const auto& e : bags[v]) {
+			const uint32_t w = std::get<0>(e);
+			if (w <= u) continue;
+			const uint32_t d = D[v] + std::get<1>(e);
+			const uint64_t c = std::min<uint64_t>(C[v] * std::get<2>(e), kUBC);
+			if (d < D[w]) {
+				if (UINT32_MAX == D[w]) reset.push_back(w);
+				D[w] = d; C[w] = c;
+				Q.emplace(d, w);
+			} else if (d == D[w]) {
+				C[w] = std::min<uint64_t>(C[w] + c, kUBC);
+			}
+		}
+	}
+
+	for (const uint32_t v : reset) {
+		D[v] = UINT32_MAX; C[v] = 0;
+	}
+	for (const auto e : dL_[u]) dLu[LEExtractV(e)] = UINT32_MAX;
+
+	}
+
+	// tree labels, from the top of the tree down
+	std::vector<uint32_t> touched;
+	auto relax = [&D, &C, &touched](const uint32_t h, const uint32_t d, const uint64_t c) {
+		if (UINT32_MAX == D[h]) touched.push_back(h);
+		if (d < D[h]) {
+			D[h] = d; C[h] = std::min<uint64_t>(c, kUBC);
+		} else if (d == D[h]) {
+			C[h] = std::min<uint64_t>(C[h] + c, kUBC);
+		}
+	};
+	for (uint32_t v = core; v < n_; ++v) {
+		bar.update();
+		for (const auto& e : bags[v]) {
+			const uint32_t x = std::get<0>(e);
+			if (x < core) {
+				relax(x, std::get<1>(e), std::get<2>(e));
+				continue;
+			}
+			for (const auto f : dL_[x]) {
+				relax(LEExtractV(f), std::get<1>(e) + LEExtractD(f), std::get<2>(e) * LEExtractC(f));
+			}
+		}
+		relax(v, 0, 1);
+
+		std::sort(touched.begin(), touched.end());
+		dL_[v].reserve(touched.size());
+		for (const uint32_t h : touched) {
+			NormalD(D[h]);
+			dL_[v].push_back(LEMerge(h, D[h], C[h]));
+			D[h] = UINT32_MAX; C[h] = 0;
+		}
+		touched.clear();
+	}
+}
+
+
+// Folding: degree-1 vertices are peeled until none is left, so every peeled
+// vertex hangs in a tree from a kernel vertex, its root, and reaches the
+// rest of the graph through it only. Kernel vertices with the same kernel
+// neighbours (open twins, at distance 2) or the same closed neighbourhoods
+// (closed twins, adjacent) are interchangeable on shortest paths, and a
+// shortest path visits at most one of them, so the first of each class in
+// the order represents it with the class size as multiplicity. Only the
+// representatives get labels; their BFSs weigh the paths through a vertex
+// by its multiplicity. Twins are ranked right after their representative
+// and the tree vertices last, by depth, which USPCUpdate::ExpandFold relies on.
+void USPCIndex::Fold() {
+	std::vector<uint32_t> deg(n_), parent(n_), peeled, stack;
+	std::vector<bool> kernel(n_, true);
+	for (uint32_t v = 0; v < n_; ++v) {
+		deg[v] = G_[v].size();
+		if (1 == deg[v]) stack.push_back(v);
+	}
+	while (!stack.empty()) {
+		const uint32_t v = stack.back();
+		stack.pop_back();
+		if (!kernel[v] || 1 != deg[v]) continue;
+		kernel[v] = false;
+		peeled.push_back(v);
+		for (const uint32_t w : G_[v]) {
+			if (!kernel[w]) continue;
+			parent[v] = w;
+			if (1 == --deg[w]) stack.push_back(w);
+			break;
+		}
+	}
+	// the parent of a tree vertex is peeled after it, if at all
+	std::vector<uint32_t> root(n_), depth(n_, 0);
+	std::iota(root.begin(), root.end(), 0);
+	for (auto it = peeled.rbegin(); it != peeled.rend(); ++it) {
+		root[*it] = root[parent[*it]];
+		depth[*it] = depth[parent[*it]] + 1;
+	}
+
+	// twin classes of kernel vertices with kernel neighbours, keyed by the
+	// hashes of the open and the closed neighbourhood of their first vertex.
+	// The sorted kernel neighbours of a first vertex r are keys[key_pos[r]]
+	// on (deg[r] of them), for the equality check on a hash hit
+	std::vector<uint32_t> rep(n_), mult(n_, 1), twin_d(n_, 0);
+	std::iota(rep.begin(), rep.end(), 0);
+	std::vector<std::vector<uint32_t>> twins(n_);
+	std::unordered_multimap<uint64_t, uint32_t> open_classes, closed_classes;
+	std::vector<uint32_t> keys;
+	std::vector<uint64_t> key_pos(n_);
+	std::vector<uint32_t> N, NC, K;
+	const auto find = [&](const std::unordered_multimap<uint64_t, uint32_t>& classes,
+						  const std::vector<uint32_t>& key, const bool close) {
+		const auto range = classes.equal_range(HashList(key));
+		for (auto it = range.first; it != range.second; ++it) {
+			const uint32_t r = it->second;
+			K.assign(keys.begin() + key_pos[r], keys.begin() + key_pos[r] + deg[r]);
+			if (close) K.insert(std::lower_bound(K.begin(), K.end(), r), r);
+			if (K == key) return r;
+		}
+		return UINT32_MAX;
+	};
+	uint32_t num_twins = 0;
+	for (const uint32_t v : order_) {
+		if (!kernel[v] || 0 == deg[v]) continue;
+		N.clear();
+		for (const uint32_t w : G_[v]) {
+			if (kernel[w]) N.push_back(w);
+		}
+		std::sort(N.begin(), N.end());
+		NC = N;
+		NC.insert(std::lower_bound(NC.begin(), NC.end(), v), v);
+		uint32_t r = find(open_classes, N, false), d = 2;
+		if (UINT32_MAX == r) {
+			r = find(closed_classes, NC, true);
+			d = 1;
+		}
+		if (UINT32_MAX != r) {
+			rep[v] = r; ++mult[r]; twin_d[r] = d;
+			twins[r].push_back(v);
+			++num_twins;
+			continue;
+		}
+		key_pos[v] = keys.size();
+		keys.insert(keys.end(), N.begin(), N.end());
+		open_classes.emplace(HashList(N), v);
+		closed_classes.emplace(HashList(NC), v);
+	}
+	decltype(open_classes)().swap(open_classes);
+	decltype(closed_classes)().swap(closed_classes);
+	decltype(keys)().swap(keys);
+	if (peeled.empty() && 0 == num_twins) {
+		printf("fold: nothing to fold\n");
+		return;
+	}
+
+	std::vector<uint32_t> order;
+	order.reserve(n_);
+	for (const uint32_t v : order_) {
+		if (!kernel[v] || rep[v] != v) continue;
+		order.push_back(v);
+		order.insert(order.end(), twins[v].begin(), twins[v].end());
+	}
+	const size_t num_kernel = order.size();
+	for (const uint32_t v : order_) {
+		if (!kernel[v]) order.push_back(v);
+	}
+	std::stable_sort(order.begin() + num_kernel, order.end(),
+		[&depth](const uint32_t v1, const uint32_t v2) { return depth[v1] < depth[v2]; });
+	order_.swap(order);
+	OrderRank();
+
+	fold_.assign(n_, FoldEntry());
+	for (uint32_t v = 0; v < n_; ++v) {
+		FoldEntry& f = fold_[rank_[v]];
+		f.root = rank_[root[v]];
+		f.depth = depth[v];
+		f.parent = rank_[kernel[v]? v : parent[v]];
+		f.rep = rank_[rep[root[v]]];
+		f.mult = mult[v];
+		f.twin_d = twin_d[v];
+		// two open twins meet at any of their (kernel) neighbours
+		f.twin_c = 2 == twin_d[v]? deg[v] : twin_d[v];
+	}
+	printf("fold: %zu tree vertices, %" PRIu32 " twins, %" PRIu32 " labelled\n",
+		peeled.size(), num_twins, num_labelled());
+}
+
+uint32_t USPCIndex::num_labelled() const {
+	if (fold_.empty()) return n_;
+	uint32_t num = 0;
+	for (uint32_t r = 0; r < n_; ++r) num += fold_[r].rep == r;
+	return num;
+}
+
+
 // merge dL_ and cL_ to cL_ at index stage
 void USPCIndex::IndexMerge(){
 	for (uint32_t i = 0; i < n_; ++i) {
@@ -148,7 +756,7 @@ void USPCIndex::IndexMerge(){
 	mL.reserve(dL_[i].size() + cL_[i].size());
 	size_t di = 0, ci = 0;
 	while (di < dL_[i].size() && ci < cL_[i].size()) {
-		if (rank_[LEExtractV(dL_[i][di])] < rank_[LEExtractV(cL_[i][ci])]) {
+		if (LEExtractV(dL_[i][di]) < LEExtractV(cL_[i][ci])) {
 			mL.push_back(dL_[i][di++]);
 		} else {
 			mL.push_back(cL_[i][ci++]);
@@ -164,10 +772,11 @@ void USPCIndex::IndexMerge(){
 
  
 // index write with graph, dL_, cL_, inverted label, and order 
-// cL_ and dL_ are not merged
+// cL_ and dL_ are not merged; graph and labels are in rank space
 uint64_t USPCIndex::IndexWrite(const std::string& filename) {
 	ASSERT(0 != n_);
 	FILE* file = fopen(filename.c_str(), "wb");
+	LabelFileHeaderWrite(file, num_tree_);
 	fwrite(&n_, sizeof(n_), 1, file);
 	for (uint32_t u = 0; u < n_; ++u) {
 		const uint32_t s = G_[u].size();
@@ -193,11 +802,29 @@ uint64_t USPCIndex::IndexWrite(const std::string& filename) {
 
 	// order information
 	fwrite(order_.data(), sizeof(order_.back()), n_, file);
+	if (!fold_.empty()) {
+		fwrite(fold_.data(), sizeof(FoldEntry), n_, file);
+		const uint32_t trailer[2] = {n_, kFoldMagic};
+		fwrite(trailer, sizeof(trailer), 1, file);
+	}
 
 	fclose(file);
 	return num_labels;
 }
 
+// query-ready index with dL_ and cL_ merged
+uint64_t USPCIndex::QueryIndexWrite(const std::string& filename) const {
+	return USPC::QueryIndexWrite(filename,
+		[this](const uint32_t r) { return dL_[r].size() + cL_[r].size(); },
+		[this](const uint32_t r, std::vector<LabelEntry>& L) {
+			L.resize(dL_[r].size() + cL_[r].size());
+			std::merge(dL_[r].begin(), dL_[r].end(), cL_[r].begin(), cL_[r].end(), L.begin(),
+				[](const LabelEntry& l1, const LabelEntry& l2) {
+					return LEExtractV(l1) < LEExtractV(l2);
+				});
+		});
+}
+
 // fast computation
 uint32_t USPCIndex::Distance(const std::vector<uint32_t>& dLu,
 							 const std::vector<LabelEntry>& dLv) const {
@@ -225,6 +852,132 @@ void USPCIndex::DegreeOrder(const Graph& graph) {
 			});
 }
 
+// Brandes' dependency accumulation from num_samples_ sources, picked with a
+// fixed seed: vertices on many shortest paths cover many pairs as hubs
+void USPCIndex::BetweennessOrder(const Graph& graph) {
+	std::vector<double> bc(n_, 0), sigma(n_, 0), delta(n_, 0);
+	std::vector<uint32_t> dist(n_, UINT32_MAX);
+	std::vector<uint32_t> S; // visit order, also the FIFO queue
+	S.reserve(n_);
+
+	std::vector<uint32_t> sources(n_);
+	std::iota(sources.begin(), sources.end(), 0);
+	std::shuffle(sources.begin(), sources.end(), std::mt19937(0));
+	const uint32_t samples = std::min(num_samples_, n_);
+
+	progressbar bar(samples);
+	for (uint32_t k = 0; k < samples; ++k) {
+		bar.update();
+		const uint32_t s = sources[k];
+		dist[s] = 0; sigma[s] = 1;
+		S.assign(1, s);
+		for (size_t h = 0; h < S.size(); ++h) {
+			const uint32_t u = S[h];
+			for (const auto w : graph[u]) {
+				if (dist[w] == UINT32_MAX) {
+					dist[w] = dist[u] + 1;
+					S.push_back(w);
+				}
+				if (dist[w] == dist[u] + 1) sigma[w] += sigma[u];
+			}
+		}
+		for (size_t h = S.size(); h-- > 0; ) {
+			const uint32_t w = S[h];
+			for (const auto u : graph[w]) {
+				if (dist[u] + 1 == dist[w]) delta[u] += sigma[u] / sigma[w] * (1 + delta[w]);
+			}
+			if (w != s) bc[w] += delta[w];
+		}
+		for (const auto v : S) { dist[v] = UINT32_MAX; sigma[v] = 0; delta[v] = 0; }
+	}
+
+	std::iota(order_.begin(), order_.end(), 0);
+	std::sort(order_.begin(), order_.end(),
+			[&](const uint32_t v1, const uint32_t v2) {
+				if (bc[v1] != bc[v2]) return bc[v1] > bc[v2];
+				if (graph[v1].size() != graph[v2].size()) return graph[v1].size() > graph[v2].size();
+				return v1 < v2;
+			});
+}
+
+// bucket-based k-core decomposition (Batagelj and Zaversnik): repeatedly
+// peel a vertex of least remaining degree, which is then its core number
+void USPCIndex::Peel(const Graph& graph, std::vector<uint32_t>& core,
+		std::vector<uint32_t>& peeled) const {
+	uint32_t max_deg = 0;
+	core.resize(n_);
+	for (uint32_t v = 0; v < n_; ++v) {
+		core[v] = graph[v].size();
+		max_deg = std::max(max_deg, core[v]);
+	}
+	// vertices sorted by remaining degree; bin[d] is where degree d starts
+	std::vector<uint32_t> bin(max_deg + 1, 0), pos(n_);
+	peeled.resize(n_);
+	for (uint32_t v = 0; v < n_; ++v) ++bin[core[v]];
+	for (uint32_t d = 0, start = 0; d <= max_deg; ++d) {
+		const uint32_t num = bin[d];
+		bin[d] = start;
+		start += num;
+	}
+	for (uint32_t v = 0; v < n_; ++v) {
+		pos[v] = bin[core[v]]++;
+		peeled[pos[v]] = v;
+	}
+	for (uint32_t d = max_deg; d > 0; --d) bin[d] = bin[d - 1];
+	bin[0] = 0;
+
+	for (uint32_t i = 0; i < n_; ++i) {
+		const uint32_t v = peeled[i];
+		for (const auto u : graph[v]) {
+			if (core[u] <= core[v]) continue;
+			// move u to the front of its bin, then shrink the bin past it
+			const uint32_t du = core[u], pu = pos[u], pw = bin[du];
+			const uint32_t w = peeled[pw];
+			if (u != w) {
+				pos[u] = pw; peeled[pu] = w;
+				pos[w] = pu; peeled[pw] = u;
+			}
+			++bin[du];
+			--core[u];
+		}
+	}
+}
+
+// the last vertices peeled, deep in the densest core, rank highest
+void USPCIndex::CoreOrder(const Graph& graph) {
+	std::vector<uint32_t> core, peeled;
+	Peel(graph, core, peeled);
+	std::reverse_copy(peeled.begin(), peeled.end(), order_.begin());
+}
+
+// core number first, degree within a core shell
+void USPCIndex::HybridOrder(const Graph& graph) {
+	std::vector<uint32_t> core, peeled;
+	Peel(graph, core, peeled);
+	std::iota(order_.begin(), order_.end(), 0);
+	std::sort(order_.begin(), order_.end(),
+			[&](const uint32_t v1, const uint32_t v2) {
+				if (core[v1] != core[v2]) return core[v1] > core[v2];
+				if (graph[v1].size() != graph[v2].size()) return graph[v1].size() > graph[v2].size();
+				return v1 < v2;
+			});
+}
+
+void USPCIndex::FileOrder(const Graph&) {
+	FILE* file = fopen(order_file_.c_str(), "r");
+	ASSERT_INFO(nullptr != file, "cannot open the order file");
+	uint32_t n = 0;
+	ASSERT(fscanf(file, "%" SCNu32, &n) == 1);
+	ASSERT_INFO(n == n_, "the order file has another # of vertices");
+	std::vector<bool> seen(n_, false);
+	for (uint32_t i = 0; i < n_; ++i) {
+		ASSERT(fscanf(file, "%" SCNu32, &order_[i]) == 1);
+		ASSERT_INFO(order_[i] < n_ && !seen[order_[i]], "the order file is not a permutation");
+		seen[order_[i]] = true;
+	}
+	fclose(file);
+}
+
 
 /*
 *******************
@@ -233,55 +986,415 @@ void USPCIndex::DegreeOrder(const Graph& graph) {
 */
 
 
+namespace {
+
+// accumulate a common hub into (sp_d, sp_c)
+inline void CountHub(const LabelEntry l1, const LabelEntry l2,
+					 uint32_t& sp_d, uint64_t& sp_c) {
+	const uint32_t d = LEExtractD(l1) + LEExtractD(l2);
+	if (d < sp_d) {
+		sp_d = d;
+		sp_c = static_cast<uint64_t>(LEExtractC(l1)) * LEExtractC(l2);
+	} else if (d == sp_d) {
+		uint64_t c = static_cast<uint64_t>(LEExtractC(l1)) * LEExtractC(l2);
+		sp_c += c;
+	}
+}
+
+// scalar two-pointer merge, also used for the tails of the simd kernels
+inline void CountTail(const uint32_t* h1, const LabelEntry* e1, size_t i, const size_t n1,
+					  const uint32_t* h2, const LabelEntry* e2, size_t j, const size_t n2,
+					  uint32_t& sp_d, uint64_t& sp_c) {
+	while (i < n1 && j < n2) {
+		if (h1[i] < h2[j]) ++i;
+		else if (h1[i] > h2[j]) ++j;
+		else CountHub(e1[i++], e2[j++], sp_d, sp_c);
+	}
+}
+
+std::pair<uint32_t, uint64_t> CountScalar(
+		const uint32_t* h1, const LabelEntry* e1, const size_t n1,
+		const uint32_t* h2, const LabelEntry* e2, const size_t n2) {
+	uint32_t sp_d = UINT32_MAX;
+	uint64_t sp_c = 0;
+	CountTail(h1, e1, 0, n1, h2, e2, 0, n2, sp_d, sp_c);
+	return std::make_pair(sp_d, sp_c);
+}
+
+// block kernels: compare a block of W hubs of one label against a block of
+// W hubs of the other with W rotations, collect the matching lanes on both
+// sides as bit masks (hubs are unique, so the k-th match of one mask pairs
+// with the k-th of the other), then advance the block with the smaller max.
+// After r rotations lane k of one block faces lane (k + r) mod W of the
+// other, so the other side's mask is eq rotated left by r, computed as
+// eq << r with the bits past W folded back. set_kernel picks the avx512
+// kernel only if the cpu has avx512f. Only Count on a flat index, the tree
+// hub part of CountTree and CountFold without twins use these kernels (as
+// does CountBatch); the other paths merge in scalar code.
+__attribute__((target("avx2")))
+std::pair<uint32_t, uint64_t> CountAVX2(
+		const uint32_t* h1, const LabelEntry* e1, const size_t n1,
+		const uint32_t* h2, const LabelEntry* e2, const size_t n2) {
+	uint32_t sp_d = UINT32_MAX;
+	uint64_t sp_c = 0;
+	const __m256i rot1 = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+	size_t i = 0, j = 0;
+	while (i + 8 <= n1 && j + 8 <= n2) {
+		const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(h1 + i));
+		__m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(h2 + j));
+		uint32_t ma = 0, mb = 0;
+		for (uint32_t r = 0; r < 8; ++r) {
+			const uint32_t eq = _mm256_movemask_ps(
+				_mm256_castsi256_ps(_mm256_cmpeq_epi32(va, vb)));
+			ma |= eq;
+			const uint32_t rot = eq << r;
+			mb |= (rot | (rot >> 8)) & 0xFF;
+			vb = _mm256_permutevar8x32_epi32(vb, rot1);
+		}
+		while (ma) {
+			CountHub(e1[i + __builtin_ctz(ma)], e2[j + __builtin_ctz(mb)], sp_d, sp_c);
+			ma &= ma - 1; mb &= mb - 1;
+		}
+		const uint32_t a_max = h1[i + 7], b_max = h2[j + 7];
+		i += (a_max <= b_max) ? 8 : 0;
+		j += (b_max <= a_max) ? 8 : 0;
+	}
+	CountTail(h1, e1, i, n1, h2, e2, j, n2, sp_d, sp_c);
+	return std::make_pair(sp_d, sp_c);
+}
+
+__attribute__((target("avx512f")))
+std::pair<uint32_t, uint64_t> CountAVX512(
+		const uint32_t* h1, const LabelEntry* e1, const size_t n1,
+		const uint32_t* h2, const LabelEntry* e2, const size_t n2) {
+	uint32_t sp_d = UINT32_MAX;
+	uint64_t sp_c = 0;
+	size_t i = 0, j = 0;
+	while (i + 16 <= n1 && j + 16 <= n2) {
+		const __m512i va = _mm512_loadu_si512(h1 + i);
+		__m512i vb = _mm512_loadu_si512(h2 + j);
+		uint32_t ma = 0, mb = 0;
+		for (uint32_t r = 0; r < 16; ++r) {
+			const uint32_t eq = _mm512_cmpeq_epi32_mask(va, vb);
+			ma |= eq;
+			const uint32_t rot = eq << r;
+			mb |= (rot | (rot >> 16)) & 0xFFFF;
+			vb = _mm512_alignr_epi32(vb, vb, 1);
+		}
+		while (ma) {
+			CountHub(e1[i + __builtin_ctz(ma)], e2[j + __builtin_ctz(mb)], sp_d, sp_c);
+			ma &= ma - 1; mb &= mb - 1;
+		}
+		const uint32_t a_max = h1[i + 15], b_max = h2[j + 15];
+		i += (a_max <= b_max) ? 16 : 0;
+		j += (b_max <= a_max) ? 16 : 0;
+	}
+	CountTail(h1, e1, i, n1, h2, e2, j, n2, sp_d, sp_c);
+	return std::make_pair(sp_d, sp_c);
+}
+
+// f(h, d, c) for every path of the core part of the label of r: the
+// entries of a core vertex, or each interface entry (a, d, c) of a tree
+// vertex (hub a < core) continued by an entry of the label of a
+template <typename F>
+void ForCorePaths(const FlatLabelView& lv, const uint32_t r, const uint32_t core, F f) {
+	if (r < core) {
+		for (const LabelEntry* p = lv.begin(r); p != lv.end(r); ++p) {
+			f(LEExtractV(*p), LEExtractD(*p), static_cast<uint64_t>(LEExtractC(*p)));
+		}
+		return;
+	}
+	for (const LabelEntry* p = lv.begin(r); p != lv.end(r) && LEExtractV(*p) < core; ++p) {
+		const uint32_t a = LEExtractV(*p), da = LEExtractD(*p);
+		const uint64_t ca = LEExtractC(*p);
+		for (const LabelEntry* q = lv.begin(a); q != lv.end(a); ++q) {
+			f(LEExtractV(*q), da + LEExtractD(*q), ca * LEExtractC(*q));
+		}
+	}
+}
+
+} // namespace
+
+void USPCQuery::set_kernel(const KernelScheme ks) {
+	__builtin_cpu_init();
+	const bool avx512 = __builtin_cpu_supports("avx512f");
+	const bool avx2 = __builtin_cpu_supports("avx2");
+	if ((KernelScheme::kAuto == ks || KernelScheme::kAVX512 == ks) && avx512) {
+		kernel_ = CountAVX512; kernel_name_ = "avx512";
+	} else if ((KernelScheme::kAuto == ks || KernelScheme::kAVX2 == ks) && avx2) {
+		kernel_ = CountAVX2; kernel_name_ = "avx2";
+	} else {
+		kernel_ = CountScalar; kernel_name_ = "scalar";
+	}
+}
+
+USPCQuery::~USPCQuery() {
+	if (nullptr != map_) munmap(map_, map_bytes_);
+}
+
 // Query of Dis and Cnt
 std::pair<uint32_t, uint64_t> USPCQuery::Count(uint32_t v1, uint32_t v2) const {
 	ASSERT(v1 != v2);
+	v1 = qrank_[v1]; v2 = qrank_[v2];
+	if (unlikely(std::max(v1, v2) >= n_ - num_tree_)) return CountTree(v1, v2);
+	if (unlikely(nullptr != qfold_)) return CountFold(v1, v2);
+	if (unlikely(compressed())) return CountCompressed(v1, v2);
 	// count the # of shortest paths
+	const uint64_t o1 = lv_.offsets[v1], o2 = lv_.offsets[v2];
+	if (lv_.hubs[o1] != lv_.hubs[o2]) return std::make_pair(0, 0); // other component
+	auto res = kernel_(lv_.hubs + o1, lv_.entries + o1, lv_.offsets[v1 + 1] - o1,
+					   lv_.hubs + o2, lv_.entries + o2, lv_.offsets[v2 + 1] - o2);
+
+	if (res.first == UINT32_MAX || res.second == 0) res.first = 0;
+	return res;
+}
+
+
+// core-tree index, r1 or r2 a tree vertex. A shortest path either stays
+// in the tree, where its highest vertex is a tree hub of both labels, or
+// enters the core; then it is split at the first and the last core vertex
+// it visits, which are interface entries of the tree labels.
+std::pair<uint32_t, uint64_t> USPCQuery::CountTree(const uint32_t r1, const uint32_t r2) const {
+	const uint32_t core = n_ - num_tree_;
 	uint32_t sp_d = UINT32_MAX;
 	uint64_t sp_c = 0;
+	if (r1 >= core && r2 >= core) {
+		const uint64_t o1 = std::lower_bound(lv_.hubs + lv_.offsets[r1],
+			lv_.hubs + lv_.offsets[r1 + 1], core) - lv_.hubs;
+		const uint64_t o2 = std::lower_bound(lv_.hubs + lv_.offsets[r2],
+			lv_.hubs + lv_.offsets[r2 + 1], core) - lv_.hubs;
+		std::tie(sp_d, sp_c) = kernel_(lv_.hubs + o1, lv_.entries + o1, lv_.offsets[r1 + 1] - o1,
+									   lv_.hubs + o2, lv_.entries + o2, lv_.offsets[r2 + 1] - o2);
+	}
 
-	size_t p1 = 0, p2 = 0;
-	while (p1 < cL_[v1].size() && p2 < cL_[v2].size()) {
-		const uint32_t w1 = LEExtractV(cL_[v1][p1]);
-		const uint32_t w2 = LEExtractV(cL_[v2][p2]);
-		if (rank_[w1] < rank_[w2]) ++p1;
-		else if (rank_[w1] > rank_[w2]) ++p2;
-		else {
-		const uint32_t d = LEExtractD(cL_[v1][p1]) +
-			LEExtractD(cL_[v2][p2]);
+	// the paths of r1 are folded into a dense array by hub, those of r2
+	// look it up
+	thread_local std::vector<uint32_t> D;
+	thread_local std::vector<uint64_t> C;
+	thread_local std::vector<uint32_t> touched;
+	if (D.size() < core) {
+		D.assign(core, UINT32_MAX); C.assign(core, 0);
+	}
+	ForCorePaths(lv_, r1, core, [](const uint32_t h, const uint32_t d, const uint64_t c) {
+		if (UINT32_MAX == D[h]) touched.push_back(h);
+		if (d < D[h]) {
+			D[h] = d; C[h] = c;
+		} else if (d == D[h]) {
+			C[h] += c;
+		}
+	});
+	ForCorePaths(lv_, r2, core, [&sp_d, &sp_c](const uint32_t h, uint32_t d, const uint64_t c) {
+		if (UINT32_MAX == D[h]) return;
+		d += D[h];
 		if (d < sp_d) {
-			sp_d = d;
-			sp_c = static_cast<uint64_t>(LEExtractC(cL_[v1][p1])) *
-				LEExtractC(cL_[v2][p2]);
+			sp_d = d; sp_c = c * C[h];
 		} else if (d == sp_d) {
-			uint64_t c = static_cast<uint64_t>(LEExtractC(cL_[v1][p1])) *
-				LEExtractC(cL_[v2][p2]);
-			sp_c += c;
+			sp_c += c * C[h];
 		}
-		++p1; ++p2;
+	});
+	for (const uint32_t h : touched) {
+		D[h] = UINT32_MAX; C[h] = 0;
+	}
+	touched.clear();
+
+	if (sp_d == UINT32_MAX || sp_c == 0) return std::make_pair(0, 0);
+	return std::make_pair(sp_d, sp_c);
+}
+
+void USPCQuery::SetFold(const FoldEntry* fold) {
+	qfold_ = fold;
+	twins_ = false;
+	for (uint32_t r = 0; r < n_; ++r) twins_ |= fold[r].mult > 1;
+	// a parent ranks above its children. The jump of a vertex depends only
+	// on its depth, and any ancestor is reached in O(log depth) jumps
+	jump_.resize(n_);
+	for (uint32_t r = 0; r < n_; ++r) {
+		const uint32_t p = fold[r].parent;
+		if (p == r) { jump_[r] = r; continue; }
+		const uint32_t j = jump_[p];
+		jump_[r] = fold[p].depth - fold[j].depth == fold[j].depth - fold[jump_[j]].depth? jump_[j] : p;
+	}
+}
+
+// the ancestor of r at depth
+uint32_t USPCQuery::Ancestor(uint32_t r, const uint32_t depth) const {
+	while (qfold_[r].depth > depth) r = qfold_[jump_[r]].depth >= depth? jump_[r] : qfold_[r].parent;
+	return r;
+}
+
+// folded index: a tree vertex is depth steps from its root along the only
+// path there, so two vertices in the same tree meet at their lowest common
+// ancestor, and all others at a shortest path between the representatives
+// of their roots. With twins, a common hub h stands for mult(h) hubs,
+// unless it is an end of the path.
+std::pair<uint32_t, uint64_t> USPCQuery::CountFold(uint32_t r1, uint32_t r2) const {
+	const FoldEntry& f1 = qfold_[r1];
+	const FoldEntry& f2 = qfold_[r2];
+	if (f1.root == f2.root) {
+		const uint32_t depth = std::min(f1.depth, f2.depth);
+		r1 = Ancestor(r1, depth); r2 = Ancestor(r2, depth);
+		// at equal depth the jumps are equal too
+		while (r1 != r2) {
+			if (jump_[r1] != jump_[r2]) { r1 = jump_[r1]; r2 = jump_[r2]; }
+			else { r1 = qfold_[r1].parent; r2 = qfold_[r2].parent; }
 		}
+		return std::make_pair(f1.depth + f2.depth - 2 * qfold_[r1].depth, 1);
 	}
+	const uint32_t a = f1.rep, b = f2.rep;
+	const uint32_t depth = f1.depth + f2.depth;
+	if (a == b) return std::make_pair(depth + qfold_[a].twin_d, qfold_[a].twin_c);
+
+	const uint64_t oa = lv_.offsets[a], ob = lv_.offsets[b];
+	if (lv_.hubs[oa] != lv_.hubs[ob]) return std::make_pair(0, 0); // other component
+	std::pair<uint32_t, uint64_t> res;
+	if (!twins_) {
+		res = kernel_(lv_.hubs + oa, lv_.entries + oa, lv_.offsets[a + 1] - oa,
+					  lv_.hubs + ob, lv_.entries + ob, lv_.offsets[b + 1] - ob);
+	} else {
+		uint32_t sp_d = UINT32_MAX;
+		uint64_t sp_c = 0;
+		for (uint64_t i = oa, j = ob; i < lv_.offsets[a + 1] && j < lv_.offsets[b + 1]; ) {
+			const uint32_t h = lv_.hubs[i];
+			if (h < lv_.hubs[j]) ++i;
+			else if (h > lv_.hubs[j]) ++j;
+			else {
+				const uint64_t m = h == a || h == b? 1 : qfold_[h].mult;
+				const uint32_t d = LEExtractD(lv_.entries[i]) + LEExtractD(lv_.entries[j]);
+				const uint64_t c = m * LEExtractC(lv_.entries[i]) * LEExtractC(lv_.entries[j]);
+				if (d < sp_d) {
+					sp_d = d; sp_c = c;
+				} else if (d == sp_d) {
+					sp_c += c;
+				}
+				++i; ++j;
+			}
+		}
+		res = std::make_pair(sp_d, sp_c);
+	}
+	if (res.first == UINT32_MAX || res.second == 0) return std::make_pair(0, 0);
+	res.first += depth;
+	return res;
+}
 
-	if (sp_d == UINT32_MAX || sp_c == 0) sp_d = 0;
+// compressed index: both labels are decoded while they are merged, and
+// the smaller side skips the blocks that end below the other's hub
+std::pair<uint32_t, uint64_t> USPCQuery::CountCompressed(const uint32_t r1, const uint32_t r2) const {
+	CompressedCursor a(zv_, r1), b(zv_, r2);
+	a.Next(); b.Next();
+	if (a.v != b.v) return std::make_pair(0, 0); // other component
+	uint32_t sp_d = UINT32_MAX;
+	uint64_t sp_c = 0;
+	while (true) {
+		if (a.v < b.v) {
+			if (!a.Seek(b.v)) break;
+		} else if (a.v > b.v) {
+			if (!b.Seek(a.v)) break;
+		} else {
+			const uint32_t d = a.d + b.d;
+			if (d < sp_d) {
+				sp_d = d; sp_c = static_cast<uint64_t>(a.c) * b.c;
+			} else if (d == sp_d) {
+				sp_c += static_cast<uint64_t>(a.c) * b.c;
+			}
+			if (!a.Next() || !b.Next()) break;
+		}
+	}
+	if (sp_d == UINT32_MAX || sp_c == 0) return std::make_pair(0, 0);
 	return std::make_pair(sp_d, sp_c);
 }
 
+// each query passes through three stages before it is merged: its two rank
+// entries are prefetched kAhead queries ahead, its offsets kAhead / 2
+// queries ahead (ranks are ready by then), and the heads of its hub and
+// entry arrays kAhead / 4 queries ahead
+void USPCQuery::CountBatch(const std::pair<uint32_t, uint32_t>* queries, const size_t num,
+						   std::pair<uint32_t, uint64_t>* results) const {
+	if (compressed()) {
+		// the decoder cannot start ahead of the merge; one by one
+		for (size_t i = 0; i < num; ++i) results[i] = Count(queries[i].first, queries[i].second);
+		return;
+	}
+	constexpr size_t kAhead = 16; // power of 2, ring size
+	constexpr uint64_t kLine = 64;
+	uint32_t r1[kAhead], r2[kAhead];
+	auto prefetch_head = [this](const uint32_t r) {
+		const uint64_t o = lv_.offsets[r];
+		const char* h = reinterpret_cast<const char*>(lv_.hubs + o);
+		const char* e = reinterpret_cast<const char*>(lv_.entries + o);
+		__builtin_prefetch(h); __builtin_prefetch(h + kLine);
+		__builtin_prefetch(e); __builtin_prefetch(e + kLine);
+		__builtin_prefetch(e + 2 * kLine); __builtin_prefetch(e + 3 * kLine);
+	};
+	// prime the stages of the first queries
+	for (size_t i = 0; i < std::min(num, kAhead); ++i) {
+		__builtin_prefetch(qrank_ + queries[i].first);
+		__builtin_prefetch(qrank_ + queries[i].second);
+	}
+	for (size_t i = 0; i < std::min(num, kAhead / 2); ++i) {
+		r1[i % kAhead] = qrank_[queries[i].first];
+		r2[i % kAhead] = qrank_[queries[i].second];
+		__builtin_prefetch(lv_.offsets + r1[i % kAhead]);
+		__builtin_prefetch(lv_.offsets + r2[i % kAhead]);
+	}
+	for (size_t i = 0; i < std::min(num, kAhead / 4); ++i) {
+		prefetch_head(r1[i % kAhead]); prefetch_head(r2[i % kAhead]);
+	}
+
+	for (size_t i = 0; i < num; ++i) {
+		if (i + kAhead < num) {
+			__builtin_prefetch(qrank_ + queries[i + kAhead].first);
+			__builtin_prefetch(qrank_ + queries[i + kAhead].second);
+		}
+		if (i + kAhead / 2 < num) {
+			const size_t j = i + kAhead / 2;
+			r1[j % kAhead] = qrank_[queries[j].first];
+			r2[j % kAhead] = qrank_[queries[j].second];
+			__builtin_prefetch(lv_.offsets + r1[j % kAhead]);
+			__builtin_prefetch(lv_.offsets + r2[j % kAhead]);
+		}
+		if (i + kAhead / 4 < num) {
+			const size_t j = (i + kAhead / 4) % kAhead;
+			prefetch_head(r1[j]); prefetch_head(r2[j]);
+		}
+
+		ASSERT(queries[i].first != queries[i].second);
+		const uint32_t v1 = r1[i % kAhead], v2 = r2[i % kAhead];
+		if (unlikely(std::max(v1, v2) >= n_ - num_tree_)) {
+			results[i] = CountTree(v1, v2);
+			continue;
+		}
+		if (unlikely(nullptr != qfold_)) {
+			results[i] = CountFold(v1, v2);
+			continue;
+		}
+		const uint64_t o1 = lv_.offsets[v1], o2 = lv_.offsets[v2];
+		if (lv_.hubs[o1] != lv_.hubs[o2]) { // other component
+			results[i] = std::make_pair(0, 0);
+			continue;
+		}
+		auto res = kernel_(lv_.hubs + o1, lv_.entries + o1, lv_.offsets[v1 + 1] - o1,
+						   lv_.hubs + o2, lv_.entries + o2, lv_.offsets[v2 + 1] - o2);
+		if (res.first == UINT32_MAX || res.second == 0) res.first = 0;
+		results[i] = res;
+	}
+}
 
 // BiBFS Dis and Cnt
 std::pair<uint32_t, uint64_t> USPCQuery::bi_BFS_Count(Graph& graph, uint32_t v1, uint32_t v2) {
+	if (bws_.D[0].size() != graph.size()) bws_.Init(graph.size());
+	return bi_BFS_Count(graph, v1, v2, bws_);
+}
+
+std::pair<uint32_t, uint64_t> USPCQuery::bi_BFS_Count(const Graph& graph, uint32_t v1, uint32_t v2,
+													   BiBFSWorkspace& ws) const {
 
 	uint32_t sp_d = UINT32_MAX;
 	uint64_t sp_c = 0;
 
     // bidirectional BFS
-    std::vector<TwoLayerQueue> qque;
-    std::vector<uint32_t> qdist[2];
-    std::vector<uint32_t> qcnt[2];
-
-    qdist[0].resize(n_, UINT32_MAX); qcnt[0].resize(n_, 0);
-    qdist[1].resize(n_, UINT32_MAX); qcnt[1].resize(n_, 0);
-    
-    qque.push_back(TwoLayerQueue(n_)); qque.push_back(TwoLayerQueue(n_));
+    std::vector<TwoLayerQueue>& qque = ws.Q;
+    std::vector<uint32_t>* const qdist = ws.D;
+    std::vector<uint32_t>* const qcnt = ws.C;
     
     int found_flag = 0;
 
@@ -290,8 +1403,7 @@ std::pair<uint32_t, uint64_t> USPCQuery::bi_BFS_Count(Graph& graph, uint32_t v1,
         qque[dir].clear();
         qque[dir].push(v);
         qque[dir].next();
-        qdist[dir][v] = 0;
-        qcnt[dir][v] = 1;
+        ws.Visit(dir, v, 0, 1);
     }
 
     uint32_t res = UINT32_MAX, dis[2] = {0, 0};
@@ -311,8 +1423,7 @@ std::pair<uint32_t, uint64_t> USPCQuery::bi_BFS_Count(Graph& graph, uint32_t v1,
 				// first met, or meet again, accumulate counting
 				if (qdist[use][w] == UINT32_MAX) {
 
-					qdist[use][w] = qdist[use][v] + 1;
-					qcnt[use][w] = qcnt[use][v];
+					ws.Visit(use, w, qdist[use][v] + 1, qcnt[use][v]);
 					if (!found_flag)
 						qque[use].push(w);
 
@@ -338,6 +1449,7 @@ std::pair<uint32_t, uint64_t> USPCQuery::bi_BFS_Count(Graph& graph, uint32_t v1,
 
     }
     LOOP_END:
+	ws.Reset();
 
 	if (sp_d == UINT32_MAX || sp_c == 0) sp_d = 0;
 	return std::make_pair(sp_d, sp_c);
@@ -345,10 +1457,39 @@ std::pair<uint32_t, uint64_t> USPCQuery::bi_BFS_Count(Graph& graph, uint32_t v1,
 }
 
 
-// cL_ and dL_ are not merged when reading
+// the order is stored after the labels; read it first so that the labels
+// can be merged by rank while they are loaded. Returns the # of bytes
+// between the current position and the order
+uint64_t USPCQuery::ReadOrder(FILE* file) {
+	const long pos = ftell(file);
+	// a folded index ends with fold[n] and [n][kFoldMagic]
+	uint32_t trailer[2];
+	ASSERT(0 == fseek(file, -static_cast<long>(sizeof(trailer)), SEEK_END));
+	ASSERT(fread(trailer, sizeof(trailer), 1, file) == 1);
+	long tail = 0;
+	if (kFoldMagic == trailer[1]) {
+		ASSERT_INFO(trailer[0] == n_, "corrupted label file");
+		tail = static_cast<long>(sizeof(FoldEntry) * n_ + sizeof(trailer));
+		ASSERT(0 == fseek(file, -tail, SEEK_END));
+		fold_.resize(n_);
+		ASSERT(fread(fold_.data(), sizeof(FoldEntry), n_, file) == n_);
+	}
+	const long order_bytes = static_cast<long>(sizeof(uint32_t)) * n_ + tail;
+	ASSERT(0 == fseek(file, -order_bytes, SEEK_END));
+	const long order_pos = ftell(file);
+	order_.resize(n_);
+	ASSERT(fread(order_.data(), sizeof(order_.back()), n_, file) == n_);
+	rank_.resize(n_);
+	OrderRank();
+	ASSERT(0 == fseek(file, pos, SEEK_SET));
+	return order_pos - pos;
+}
+
+// cL_ and dL_ are not merged in the file, they are merged into fL_ when reading
 void USPCQuery::IndexRead(const std::string& filename) {
-	ASSERT(dL_.empty() && cL_.empty() && G_.empty()); // && inv_L_.empty()
+	ASSERT(fL_.entries.empty() && G_.empty());
 	FILE* file = fopen(filename.c_str(), "rb");
+	num_tree_ = LabelFileHeaderRead(file).num_tree;
 	ASSERT(fread(&n_, sizeof(n_), 1, file) == 1);
 	G_.resize(n_);
 	// read graph
@@ -358,75 +1499,72 @@ void USPCQuery::IndexRead(const std::string& filename) {
 		G_[u].resize(s);
 		ASSERT(fread(G_[u].data(), sizeof(G_[u].back()), s, file) == s);
 	}
+	const uint64_t label_bytes = ReadOrder(file);
+
 	// initialization
-	dL_.resize(n_);
-	cL_.resize(n_);
+	fL_.offsets.assign(n_ + 1, 0);
+	fL_.entries.reserve(label_bytes / sizeof(LabelEntry));
 
 	// read labels
 	uint64_t num_labels = 0;
 	uint64_t num_dlabels = 0;
 	uint64_t num_clabels = 0;
-	uint32_t d_s, c_s, i_s;
+	uint32_t d_s, c_s;
+	std::vector<LabelEntry> dL, cL;
 	for (uint32_t i = 0; i < n_; ++i) {
 		// read canonical labels
 		ASSERT(fread(&d_s, sizeof(d_s), 1, file) == 1);
-		dL_[i].resize(d_s);
-		ASSERT(fread(dL_[i].data(), sizeof(dL_[i].back()), d_s, file) == d_s);
+		dL.resize(d_s);
+		ASSERT(fread(dL.data(), sizeof(LabelEntry), d_s, file) == d_s);
 		num_labels += d_s;
 		num_dlabels += d_s;
 
 		// read non-canonical labels
 		ASSERT(fread(&c_s, sizeof(c_s), 1, file) == 1);
-		cL_[i].resize(c_s);
-		ASSERT(fread(cL_[i].data(), sizeof(cL_[i].back()), c_s, file) == c_s);
-
+		cL.resize(c_s);
+		ASSERT(fread(cL.data(), sizeof(LabelEntry), c_s, file) == c_s);
 		num_labels += c_s;
 		num_clabels += c_s;
-	}
-	printf("total # of labels entries:\t%" PRIu64 "\n", num_labels);
-	printf("total # of can-labels	:\t%" PRIu64 "\n", num_dlabels);
-	printf("total # of non-can-labels:\t%" PRIu64 "\n", num_clabels);
 
-	// order information
-	order_.resize(n_);
-	ASSERT(fread(order_.data(), sizeof(order_.back()), n_, file) == n_);
-	rank_.resize(n_);
-	OrderRank();
-	// check
-	for (uint32_t i = 0; i < n_; ++i) {
-		for (size_t j = 1; j < dL_[i].size(); ++j) {
-			ASSERT(rank_[LEExtractV(dL_[i][j])] >
-					rank_[LEExtractV(dL_[i][j - 1])]);
+		// check
+		for (size_t j = 1; j < dL.size(); ++j) {
+			ASSERT(LEExtractV(dL[j]) > LEExtractV(dL[j - 1]));
 		}
-		for (size_t j = 1; j < cL_[i].size(); ++j) {
-			ASSERT(rank_[LEExtractV(cL_[i][j])] >
-					rank_[LEExtractV(cL_[i][j - 1])]);
+		for (size_t j = 1; j < cL.size(); ++j) {
+			ASSERT(LEExtractV(cL[j]) > LEExtractV(cL[j - 1]));
 		}
-	}
-	
-	// reorganize the labels
-	for (uint32_t i = 0; i < n_; ++i) {
+
 		// merge
-		std::vector<LabelEntry> mL;
-		mL.reserve(dL_[i].size() + cL_[i].size());
 		size_t di = 0, ci = 0;
-		while (di < dL_[i].size() && ci < cL_[i].size()) {
-			if (rank_[LEExtractV(dL_[i][di])] < rank_[LEExtractV(cL_[i][ci])]) {
-				mL.push_back(dL_[i][di++]);
+		while (di < dL.size() && ci < cL.size()) {
+			if (LEExtractV(dL[di]) < LEExtractV(cL[ci])) {
+				fL_.entries.push_back(dL[di++]);
 			} else {
-				mL.push_back(cL_[i][ci++]);
+				fL_.entries.push_back(cL[ci++]);
 			}
 		}
-		while (di < dL_[i].size()) mL.push_back(dL_[i][di++]);
-		while (ci < cL_[i].size()) mL.push_back(cL_[i][ci++]);
-		dL_[i].clear();
-		cL_[i] = mL;
+		while (di < dL.size()) fL_.entries.push_back(dL[di++]);
+		while (ci < cL.size()) fL_.entries.push_back(cL[ci++]);
+		fL_.offsets[i + 1] = fL_.entries.size();
 	}
-	decltype(dL_)().swap(dL_);
+	fL_.BuildHubs();
+	lv_ = FlatLabelView(fL_);
+	qrank_ = rank_.data(); qorder_ = order_.data();
+	if (!fold_.empty()) SetFold(fold_.data());
+	if (nullptr == kernel_) set_kernel(KernelScheme::kAuto);
+	printf("total # of labels entries:\t%" PRIu64 "\n", num_labels);
+	printf("total # of can-labels	:\t%" PRIu64 "\n", num_dlabels);
+	printf("total # of non-can-labels:\t%" PRIu64 "\n", num_clabels);
+	printf("label memory:\t%.2f MB\n", fL_.bytes() / 1048576.0);
+	printf("count kernel:\t%s\n", kernel_name_);
 	printf("labels merged; ");
 
 	// check
 	bool check = false;
+	ASSERT(0 == fseek(file, sizeof(uint32_t) * n_, SEEK_CUR));
+	if (!fold_.empty()) {
+		ASSERT(0 == fseek(file, sizeof(FoldEntry) * n_ + sizeof(uint32_t) * 2, SEEK_CUR));
+	}
 	ASSERT(fread(&check, sizeof(check), 1, file) == 0);
 	fclose(file);
 
@@ -435,8 +1573,9 @@ void USPCQuery::IndexRead(const std::string& filename) {
 
 // cL_ and dL_ are merged
 void USPCQuery::IndexRead_UPD(const std::string& filename) {
-	ASSERT(cL_.empty() && G_.empty());
+	ASSERT(fL_.entries.empty() && G_.empty());
 	FILE* file = fopen(filename.c_str(), "rb");
+	ASSERT_INFO(0 == LabelFileHeaderRead(file).num_tree, "updated label files are flat");
 	ASSERT(fread(&n_, sizeof(n_), 1, file) == 1);
 	G_.resize(n_);
 
@@ -447,34 +1586,119 @@ void USPCQuery::IndexRead_UPD(const std::string& filename) {
 		G_[u].resize(s);
 		ASSERT(fread(G_[u].data(), sizeof(G_[u].back()), s, file) == s);
 	}
+	const uint64_t label_bytes = ReadOrder(file);
 
 	// initialization
-	cL_.resize(n_);
+	fL_.offsets.assign(n_ + 1, 0);
+	fL_.entries.reserve(label_bytes / sizeof(LabelEntry));
 
-	// read labels
+	// read labels straight into the arena
 	uint64_t num_labels = 0;
-	uint32_t c_s, i_s;
+	uint32_t c_s;
 	for (uint32_t i = 0; i < n_; ++i) {
 		ASSERT(fread(&c_s, sizeof(c_s), 1, file) == 1);
-		cL_[i].resize(c_s);
-		ASSERT(fread(cL_[i].data(), sizeof(cL_[i].back()), c_s, file) == c_s);
+		fL_.entries.resize(num_labels + c_s);
+		ASSERT(fread(fL_.entries.data() + num_labels, sizeof(LabelEntry), c_s, file) == c_s);
 		num_labels += c_s;
-
+		fL_.offsets[i + 1] = num_labels;
 	}
 
+	fL_.BuildHubs();
+	lv_ = FlatLabelView(fL_);
+	qrank_ = rank_.data(); qorder_ = order_.data();
+	if (nullptr == kernel_) set_kernel(KernelScheme::kAuto);
 	printf("total # of labels entries:\t%" PRIu64 "\n", num_labels);
-
-	// order information
-	order_.resize(n_);
-	ASSERT(fread(order_.data(), sizeof(order_.back()), n_, file) == n_);
-	rank_.resize(n_);
-	OrderRank();
+	printf("label memory:\t%.2f MB\n", fL_.bytes() / 1048576.0);
+	printf("count kernel:\t%s\n", kernel_name_);
 
 	fclose(file);
 }
 
+// the labels are used in place; nothing is copied or merged
+void USPCQuery::IndexMap(const std::string& filename) {
+	ASSERT(nullptr == map_ && fL_.entries.empty());
+	const int fd = open(filename.c_str(), O_RDONLY);
+	ASSERT_INFO(fd >= 0, "cannot open the query index");
+	struct stat st;
+	ASSERT(0 == fstat(fd, &st));
+	ASSERT_INFO(static_cast<uint64_t>(st.st_size) >= sizeof(QueryIndexHeader), "truncated query index");
+	void* const addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	ASSERT(MAP_FAILED != addr);
+	map_ = addr;
+	map_bytes_ = st.st_size;
+
+	const QueryIndexHeader& h = *static_cast<const QueryIndexHeader*>(map_);
+	ASSERT_INFO(0 == memcmp(h.magic, QueryIndexHeader::kMagic, sizeof(h.magic)), "not a query index");
+	ASSERT_INFO(QueryIndexHeader::kVersion == h.version, "unsupported query index version");
+	ASSERT_INFO(kEntryBits == h.entry_bits, "label entry layout differs from this build");
+	ASSERT_INFO(map_bytes_ == h.file_bytes, "truncated query index");
+
+	const char* const base = static_cast<const char*>(map_);
+	n_ = h.n;
+	num_tree_ = h.num_tree;
+	qorder_ = reinterpret_cast<const uint32_t*>(base + h.order_pos);
+	qrank_ = reinterpret_cast<const uint32_t*>(base + h.rank_pos);
+	if (0 != h.zlabels_pos) {
+		zv_.offsets = reinterpret_cast<const uint64_t*>(base + h.offsets_pos);
+		zv_.bytes = reinterpret_cast<const uint8_t*>(base + h.zlabels_pos);
+		ASSERT_INFO(h.zlabels_pos + zv_.offsets[n_] <= h.file_bytes, "corrupted query index");
+	} else {
+		lv_.offsets = reinterpret_cast<const uint64_t*>(base + h.offsets_pos);
+		lv_.entries = reinterpret_cast<const LabelEntry*>(base + h.entries_pos);
+		lv_.hubs = reinterpret_cast<const uint32_t*>(base + h.hubs_pos);
+		ASSERT_INFO(lv_.offsets[n_] == h.num_entries, "corrupted query index");
+	}
+	if (0 != h.fold_pos) SetFold(reinterpret_cast<const FoldEntry*>(base + h.fold_pos));
+
+	if (nullptr == kernel_) set_kernel(KernelScheme::kAuto);
+	printf("total # of labels entries:\t%" PRIu64 "\n", h.num_entries);
+	printf("mapped index:\t%.2f MB%s\n", map_bytes_ / 1048576.0, compressed()? " (compressed)" : "");
+	printf("count kernel:\t%s\n", compressed()? "compressed" : kernel_name_);
+}
+
+// recompute the checksum of the mapped index; reads the whole file
+bool USPCQuery::IndexVerify() const {
+	ASSERT(nullptr != map_);
+	const QueryIndexHeader& h = *static_cast<const QueryIndexHeader*>(map_);
+	Checksum sum;
+	sum.Add(static_cast<const char*>(map_) + sizeof(h), h.file_bytes - sizeof(h));
+	return sum.h == h.checksum;
+}
+
+void USPCQuery::Compress() {
+	ASSERT_INFO(0 == num_tree_ && nullptr == qfold_, "only flat indexes are compressed");
+	if (compressed()) return;
+	for (uint32_t r = 0; r < n_; ++r) zL_.Append(lv_.begin(r), lv_.end(r));
+	zL_.bytes.shrink_to_fit();
+	zv_ = CompressedLabelView(zL_);
+	lv_ = FlatLabelView();
+	std::vector<LabelEntry>().swap(fL_.entries);
+	std::vector<uint32_t>().swap(fL_.hubs);
+	std::vector<uint64_t>().swap(fL_.offsets);
+}
+
+uint64_t USPCQuery::label_bytes() const {
+	if (compressed()) return sizeof(uint64_t) * (n_ + 1) + zv_.offsets[n_];
+	return sizeof(uint64_t) * (n_ + 1) + (sizeof(LabelEntry) + sizeof(uint32_t)) * lv_.offsets[n_];
+}
+
 // update graph
+// edge updates (i, d) and vertex updates (a adds v1, the next id, r
+// removes the edges of v1); v2 is unused by the latter
 void USPCQuery::UpdateGraph(Graph& graph, uint32_t v1, uint32_t v2, char upd_type) {
+	if (upd_type == 'a') {
+		ASSERT(v1 == graph.size());
+		graph.emplace_back();
+		return;
+	}
+	if (upd_type == 'r') {
+		for (const auto u : graph[v1]) {
+			graph[u].erase(std::find(graph[u].begin(), graph[u].end(), v1));
+		}
+		graph[v1].clear();
+		return;
+	}
 	ASSERT(v1 != v2);
 
 	if (upd_type == 'i') {
@@ -501,8 +1725,15 @@ void USPCQuery::print_Label(uint32_t v) {
 	std::ofstream lfile;
 	std::string lfilename = "tmp_label/" + std::to_string(v) + "L.txt";
 	lfile.open(lfilename.c_str());
-	for (auto l:cL_[v]) {
-		lfile << rank_[LEExtractV(l)] << ": " << LEExtractV(l) << "	" << LEExtractD(l) << "	" << LEExtractC(l) << "\n";
+	if (compressed()) {
+		for (CompressedCursor p(zv_, qrank_[v]); p.Next(); ) {
+			lfile << p.v << ": " << qorder_[p.v] << "	" << p.d << "	" << p.c << "\n";
+		}
+	} else {
+		for (const LabelEntry* p = lv_.begin(qrank_[v]); p != lv_.end(qrank_[v]); ++p) {
+			const LabelEntry l = *p;
+			lfile << LEExtractV(l) << ": " << qorder_[LEExtractV(l)] << "	" << LEExtractD(l) << "	" << LEExtractC(l) << "\n";
+		}
 	}
 	lfile.close();
 }
@@ -517,8 +1748,9 @@ void USPCQuery::print_Label(uint32_t v) {
 
 // cL_ and dL_ are not merged
 void USPCUpdate::IndexRead(const std::string& filename) {
-	ASSERT(dL_.empty() && cL_.empty() && G_.empty());
+	ASSERT(cL_.empty() && G_.empty());
 	FILE* file = fopen(filename.c_str(), "rb");
+	num_tree_ = LabelFileHeaderRead(file).num_tree;
 	ASSERT(fread(&n_, sizeof(n_), 1, file) == 1);
 	G_.resize(n_);
 	// read graph
@@ -530,27 +1762,27 @@ void USPCUpdate::IndexRead(const std::string& filename) {
 	}
 
 	// initialization
-	dL_.resize(n_);
+	Label dL(n_), cL(n_);
 	cL_.resize(n_);
 
 	// read labels
 	uint64_t num_labels = 0;
 	uint64_t num_dlabels = 0;
 	uint64_t num_clabels = 0;
-	uint32_t d_s, c_s, i_s;
+	uint32_t d_s, c_s;
 	for (uint32_t i = 0; i < n_; ++i) {
 		// read canonical labels
 		ASSERT(fread(&d_s, sizeof(d_s), 1, file) == 1);
-		dL_[i].resize(d_s);
-		ASSERT(fread(dL_[i].data(), sizeof(dL_[i].back()), d_s, file) == d_s);
+		dL[i].resize(d_s);
+		ASSERT(fread(dL[i].data(), sizeof(LabelEntry), d_s, file) == d_s);
 
 		num_labels += d_s;
 		num_dlabels += d_s;
 
 		// read non-canonical labels
 		ASSERT(fread(&c_s, sizeof(c_s), 1, file) == 1);
-		cL_[i].resize(c_s);
-		ASSERT(fread(cL_[i].data(), sizeof(cL_[i].back()), c_s, file) == c_s);
+		cL[i].resize(c_s);
+		ASSERT(fread(cL[i].data(), sizeof(LabelEntry), c_s, file) == c_s);
 		
 		num_labels += c_s;
 		num_clabels += c_s;
@@ -565,15 +1797,29 @@ void USPCUpdate::IndexRead(const std::string& filename) {
 	ASSERT(fread(order_.data(), sizeof(order_.back()), n_, file) == n_);
 	rank_.resize(n_);
 	OrderRank();
+	// after the order: nothing, or fold[n] and [n][kFoldMagic] (folded)
+	const long here = ftell(file);
+	ASSERT(0 == fseek(file, 0, SEEK_END));
+	const long tail = ftell(file) - here;
+	ASSERT(0 == fseek(file, here, SEEK_SET));
+	uint32_t trailer[2];
+	if (static_cast<long>(sizeof(FoldEntry) * n_ + sizeof(trailer)) == tail) {
+		fold_.resize(n_);
+		ASSERT(fread(fold_.data(), sizeof(FoldEntry), n_, file) == n_);
+		ASSERT(fread(trailer, sizeof(trailer), 1, file) == 1);
+		ASSERT_INFO(kFoldMagic == trailer[1] && n_ == trailer[0], "corrupted label file");
+	} else {
+		ASSERT_INFO(0 == tail, "corrupted label file");
+	}
 	// check
 	for (uint32_t i = 0; i < n_; ++i) {
-		for (size_t j = 1; j < dL_[i].size(); ++j) {
-			ASSERT(rank_[LEExtractV(dL_[i][j])] >
-				rank_[LEExtractV(dL_[i][j - 1])]);
+		for (size_t j = 1; j < dL[i].size(); ++j) {
+			ASSERT(LEExtractV(dL[i][j]) >
+				LEExtractV(dL[i][j - 1]));
 		}
-		for (size_t j = 1; j < cL_[i].size(); ++j) {
-			ASSERT(rank_[LEExtractV(cL_[i][j])] >
-				rank_[LEExtractV(cL_[i][j - 1])]);
+		for (size_t j = 1; j < cL[i].size(); ++j) {
+			ASSERT(LEExtractV(cL[i][j]) >
+				LEExtractV(cL[i][j - 1]));
 		}
 	}
 
@@ -581,24 +1827,40 @@ void USPCUpdate::IndexRead(const std::string& filename) {
 	for (uint32_t i = 0; i < n_; ++i) {
 		// merge
 		std::vector<LabelEntry> mL;
-		mL.reserve(dL_[i].size() + cL_[i].size());
+		mL.reserve(dL[i].size() + cL[i].size());
 		size_t di = 0, ci = 0;
-		while (di < dL_[i].size() && ci < cL_[i].size()) {
-			if (rank_[LEExtractV(dL_[i][di])] < rank_[LEExtractV(cL_[i][ci])]) {
-				mL.push_back(dL_[i][di++]);
+		while (di < dL[i].size() && ci < cL[i].size()) {
+			if (LEExtractV(dL[i][di]) < LEExtractV(cL[i][ci])) {
+				mL.push_back(dL[i][di++]);
 			} else {
-				mL.push_back(cL_[i][ci++]);
+				mL.push_back(cL[i][ci++]);
 			}
 		}
-		while (di < dL_[i].size()) mL.push_back(dL_[i][di++]);
-		while (ci < cL_[i].size()) mL.push_back(cL_[i][ci++]);
-		dL_[i].clear();
-		cL_[i] = mL;
+		while (di < dL[i].size()) mL.push_back(dL[i][di++]);
+		while (ci < cL[i].size()) mL.push_back(cL[i][ci++]);
+		std::vector<LabelEntry>().swap(cL[i]);
+		dL[i].swap(mL);
 	}
-	decltype(dL_)().swap(dL_);
+	if (num_tree_ > 0) {
+		ExpandTree(dL);
+		num_tree_ = 0;
+	}
+	if (!fold_.empty()) {
+		ExpandFold(dL);
+		decltype(fold_)().swap(fold_);
+	}
+	for (uint32_t i = 0; i < n_; ++i) cL_[i].Assign(std::move(dL[i]));
     
 	printf("labels merged; ");
 
+	// workspaces
+	ws_.Init(n_);
+	hash_dist_.assign(n_, UINT32_MAX);
+	hash_count_.assign(n_, 0);
+	hub_a_.Init(n_); hub_b_.Init(n_);
+	aff_a_.Init(n_); aff_b_.Init(n_);
+	updated_.Init(n_);
+
 	// check
 	bool check = false;
 	ASSERT(fread(&check, sizeof(check), 1, file) == 0);
@@ -609,10 +1871,126 @@ void USPCUpdate::IndexRead(const std::string& filename) {
 
 
 
+// The flat label of a tree vertex v over hub h holds the shortest paths
+// whose vertices all rank at most h. For a tree hub those are the paths of
+// its tree entry; for a core hub they leave v through an interface entry
+// (a, d, c) and go on along the flat label of a. Taking the hubs of v by
+// rank, a candidate is kept unless a shorter path through a hub already
+// kept exists, as in the pruned BFS of the index. The flat labels of all
+// higher ranked vertices are done by then.
+void USPCUpdate::ExpandTree(Label& L) const {
+	const uint32_t core = n_ - num_tree_;
+	std::vector<uint32_t> dv(n_, UINT32_MAX); // kept entries of v
+	std::vector<uint32_t> D(n_, UINT32_MAX);
+	std::vector<uint64_t> C(n_, 0);
+	std::vector<uint32_t> touched;
+	auto relax = [&D, &C, &touched](const uint32_t h, const uint32_t d, const uint64_t c) {
+		if (UINT32_MAX == D[h]) touched.push_back(h);
+		if (d < D[h]) {
+			D[h] = d; C[h] = std::min<uint64_t>(c, kUBC);
+		} else if (d == D[h]) {
+			C[h] = std::min<uint64_t>(C[h] + c, kUBC);
+		}
+	};
+
+	for (uint32_t v = core; v < n_; ++v) {
+		for (const auto e : L[v]) {
+			const uint32_t h = LEExtractV(e);
+			if (h >= core) {
+				relax(h, LEExtractD(e), LEExtractC(e));
+				continue;
+			}
+			for (const auto f : L[h]) {
+				relax(LEExtractV(f), LEExtractD(e) + LEExtractD(f),
+					  static_cast<uint64_t>(LEExtractC(e)) * LEExtractC(f));
+			}
+		}
+		std::sort(touched.begin(), touched.end());
+
+		std::vector<LabelEntry> F;
+		for (const uint32_t h : touched) {
+			uint32_t dSoFar = UINT32_MAX;
+			if (h != v) {
+				for (const auto f : L[h]) {
+					const uint32_t d = dv[LEExtractV(f)];
+					if (UINT32_MAX != d) dSoFar = std::min(dSoFar, d + LEExtractD(f));
+				}
+			}
+			if (D[h] <= dSoFar) {
+				NormalD(D[h]);
+				F.push_back(LEMerge(h, D[h], C[h]));
+				dv[h] = D[h];
+			}
+			D[h] = UINT32_MAX; C[h] = 0;
+		}
+		for (const auto e : F) dv[LEExtractV(e)] = UINT32_MAX;
+		touched.clear();
+		L[v].swap(F);
+	}
+}
+
+// Flat labels of a folded index, with the order of USPCIndex::Fold:
+//   - a representative r of k twins stands for k consecutive ranks r, ..., r
+//     + k - 1, so its entries in other labels are repeated for the others
+//   - the twin r + i has the (repeated) entries of r above r, entries for
+//     r, ..., r + i - 1 (paths of length 2 through a kernel neighbour ranked
+//     below the hub, or the edge between closed twins) and itself
+//   - a tree vertex has the entries of its parent one step further, and
+//     itself; its parent ranks above it
+void USPCUpdate::ExpandFold(Label& L) const {
+	for (uint32_t v = 0; v < n_; ++v) {
+		if (fold_[v].rep != v) continue;
+		std::vector<LabelEntry> F;
+		for (const auto e : L[v]) {
+			const uint32_t h = LEExtractV(e);
+			F.push_back(e);
+			if (h == v) continue;
+			for (uint32_t i = 1; i < fold_[h].mult; ++i) {
+				F.push_back(LEMerge(h + i, LEExtractD(e), LEExtractC(e)));
+			}
+		}
+		L[v].swap(F);
+	}
+
+	for (uint32_t v = 0; v < n_; ++v) {
+		const FoldEntry& f = fold_[v];
+		if (f.rep == v) continue;
+		std::vector<LabelEntry> F;
+		if (0 == f.depth) {
+			for (const auto e : L[f.rep]) {
+				if (LEExtractV(e) < f.rep) F.push_back(e);
+			}
+			for (uint32_t h = f.rep; h < v; ++h) {
+				uint32_t c = 1;
+				if (2 == fold_[f.rep].twin_d) {
+					c = 0;
+					for (const uint32_t w : G_[v]) c += w > h && 0 == fold_[w].depth;
+				}
+				if (c > 0) F.push_back(LEMerge(h, fold_[f.rep].twin_d, c));
+			}
+		} else {
+			for (const auto e : L[f.parent]) {
+				NormalD(LEExtractD(e) + 1);
+				F.push_back(LEMerge(LEExtractV(e), LEExtractD(e) + 1, LEExtractC(e)));
+			}
+		}
+		F.push_back(LEMerge(v, 0, 1));
+		L[v].swap(F);
+	}
+}
+
+// query-ready index of the updated labels
+uint64_t USPCUpdate::QueryIndexWrite(const std::string& filename) const {
+	return USPC::QueryIndexWrite(filename,
+		[this](const uint32_t r) { return cL_[r].num_entries(); },
+		[this](const uint32_t r, std::vector<LabelEntry>& L) { L = cL_[r].Entries(); });
+}
+
 // cL_ and dL_ are merged
 uint64_t USPCUpdate::IndexWrite(const std::string& filename) {
 	ASSERT(0 != n_);
 	FILE* file = fopen(filename.c_str(), "wb");
+	LabelFileHeaderWrite(file, 0);
 	fwrite(&n_, sizeof(n_), 1, file);
 	for (uint32_t u = 0; u < n_; ++u) {
 		const uint32_t s = G_[u].size();
@@ -623,10 +2001,11 @@ uint64_t USPCUpdate::IndexWrite(const std::string& filename) {
 	// write label
 	uint64_t num_labels = 0;
 	for (uint32_t i = 0; i < n_; ++i) {
-		// write labels
-		const uint32_t c_s = cL_[i].size();
+		// write labels, without gaps
+		const auto L = cL_[i].Entries();
+		const uint32_t c_s = L.size();
 		fwrite(&c_s, sizeof(c_s), 1, file);
-		fwrite(cL_[i].data(), sizeof(cL_[i].back()), c_s, file);
+		fwrite(L.data(), sizeof(LabelEntry), c_s, file);
 
 		num_labels += c_s;
 	}
@@ -638,35 +2017,199 @@ uint64_t USPCUpdate::IndexWrite(const std::string& filename) {
 	return num_labels;
 }
 
-// Query 
-std::pair<uint32_t, uint64_t> USPCUpdate::Count(uint32_t v1, uint32_t v2) const {
+namespace {
+
+// Count over two labels of USPCUpdate: the gapped live ones or the
+// gap-free ones of a snapshot. A gap repeats the hub before it with count
+// 0, so it never adds a path. The same label twice is the vertex itself.
+template <typename L>
+std::pair<uint32_t, uint64_t> CountLabels(const L& L1, const L& L2) {
+	if (&L1 == &L2) return std::make_pair(0, 1);
+	if (LEExtractV(L1[0]) != LEExtractV(L2[0])) return std::make_pair(0, 0); // other component
 	size_t p1 = 0, p2 = 0;
 	uint32_t sp_d = UINT32_MAX;
 	uint64_t sp_c = 0;
-	while (p1 < cL_[v1].size() && p2 < cL_[v2].size()) {
-		const uint32_t w1 = LEExtractV(cL_[v1][p1]);
-		const uint32_t w2 = LEExtractV(cL_[v2][p2]);
-		if (rank_[w1] < rank_[w2]) ++p1;
-		else if (rank_[w1] > rank_[w2]) ++p2;
+	while (p1 < L1.size() && p2 < L2.size()) {
+		const uint32_t w1 = LEExtractV(L1[p1]);
+		const uint32_t w2 = LEExtractV(L2[p2]);
+		if (w1 < w2) ++p1;
+		else if (w1 > w2) ++p2;
 		else {
-		const uint32_t d = LEExtractD(cL_[v1][p1]) +
-			LEExtractD(cL_[v2][p2]);
-		if (d < sp_d) {
-			sp_d = d;
-			sp_c = static_cast<uint64_t>(LEExtractC(cL_[v1][p1])) *
-				LEExtractC(cL_[v2][p2]);
-		} else if (d == sp_d) {
-			uint64_t c = static_cast<uint64_t>(LEExtractC(cL_[v1][p1])) *
-				LEExtractC(cL_[v2][p2]);
-			sp_c += c;
-		}
-		++p1; ++p2;
+			const uint32_t d = LEExtractD(L1[p1]) + LEExtractD(L2[p2]);
+			const uint64_t c = static_cast<uint64_t>(LEExtractC(L1[p1])) * LEExtractC(L2[p2]);
+			if (d < sp_d) {
+				sp_d = d; sp_c = c;
+			} else if (d == sp_d) {
+				sp_c += c;
+			}
+			++p1; ++p2;
 		}
 	}
-	if (sp_d == UINT32_MAX) sp_d = 0;
+	if (sp_d == UINT32_MAX || sp_c == 0) return std::make_pair(0, 0);
 	return std::make_pair(sp_d, sp_c);
 }
 
+} // namespace
+
+// Query, v1 and v2 are in rank space
+std::pair<uint32_t, uint64_t> USPCUpdate::Count(uint32_t v1, uint32_t v2) const {
+	return CountLabels(cL_[v1], cL_[v2]);
+}
+
+// edge (v1, v2) by vertex id
+bool USPCUpdate::HasEdge(uint32_t v1, uint32_t v2) const {
+	v1 = rank_[v1]; v2 = rank_[v2];
+	if (G_[v1].size() > G_[v2].size()) std::swap(v1, v2);
+	return std::find(G_[v1].begin(), G_[v1].end(), v2) != G_[v1].end();
+}
+
+/*
+*******************
+**** Snapshots ****
+*******************
+*/
+
+USPCUpdate::~USPCUpdate() {
+	const LabelSnapshot* snap = snap_.load();
+	if (nullptr != snap) {
+		for (const auto page : snap->pages) {
+			for (const auto L : *page) delete L;
+			delete page;
+		}
+		delete snap;
+	}
+	for (auto& r : retired_) r.epoch = 0;
+	Reclaim();
+}
+
+void USPCUpdate::EnableSnapshots() {
+	ASSERT(!snapshots_ && 0 != n_);
+	const uint32_t page_size = 1u << LabelSnapshot::kPageBits;
+	auto* snap = new LabelSnapshot;
+	snap->pages.resize((n_ + page_size - 1) / page_size);
+	for (uint32_t p = 0; p < snap->pages.size(); ++p) {
+		snap->pages[p] = new LabelSnapshot::Page(page_size, nullptr);
+		for (uint32_t v = p * page_size; v < std::min(n_, (p + 1) * page_size); ++v) {
+			(*snap->pages[p])[v - p * page_size] = new std::vector<LabelEntry>(cL_[rank_[v]].Entries());
+		}
+	}
+	snap_.store(snap);
+	readers_.reset(new ReaderSlot[kMaxReaders]);
+	dirty_.Init(n_);
+	snapshots_ = true;
+}
+
+// copy the pages and labels of the vertices changed since the last publish,
+// swap the root, then retire what the new root no longer reaches. Vertices
+// added since then get their pages here; the old root has nothing to retire
+void USPCUpdate::Publish() {
+	ASSERT(snapshots_);
+	if (dirty_.touched.empty()) return;
+	const LabelSnapshot* old = snap_.load();
+	auto* snap = new LabelSnapshot(*old);
+	Retired r;
+	r.root = old;
+	const uint32_t page_size = 1u << LabelSnapshot::kPageBits;
+	snap->pages.resize((n_ + page_size - 1) / page_size, nullptr);
+	for (const uint32_t v : dirty_.touched) {
+		const uint32_t id = order_[v];
+		const uint32_t p = id >> LabelSnapshot::kPageBits;
+		if (nullptr == snap->pages[p]) {
+			snap->pages[p] = new LabelSnapshot::Page(page_size, nullptr);
+		} else if (p < old->pages.size() && snap->pages[p] == old->pages[p]) {
+			r.pages.push_back(old->pages[p]);
+			snap->pages[p] = new LabelSnapshot::Page(*old->pages[p]);
+		}
+		auto& L = (*snap->pages[p])[id & (page_size - 1)];
+		if (nullptr != L) r.labels.push_back(L);
+		L = new std::vector<LabelEntry>(cL_[v].Entries());
+	}
+	dirty_.Reset();
+
+	snap_.store(snap);
+	r.epoch = epoch_.load();
+	retired_.push_back(std::move(r));
+	epoch_.fetch_add(1);
+	Reclaim();
+}
+
+// free what was retired before the oldest epoch a reader is still in; a
+// reader that pinned a later epoch loaded its root after the swap
+void USPCUpdate::Reclaim() {
+	uint64_t oldest = UINT64_MAX;
+	for (uint32_t i = 0; nullptr != readers_ && i < kMaxReaders; ++i) {
+		const uint64_t e = readers_[i].epoch.load();
+		if (0 != e) oldest = std::min(oldest, e);
+	}
+	size_t kept = 0;
+	for (auto& r : retired_) {
+		if (r.epoch < oldest) {
+			for (const auto L : r.labels) delete L;
+			for (const auto page : r.pages) delete page;
+			delete r.root;
+		} else {
+			retired_[kept++] = std::move(r);
+		}
+	}
+	retired_.resize(kept);
+}
+
+uint32_t USPCUpdate::AddReader() {
+	ASSERT(snapshots_);
+	for (uint32_t reader = 0; reader < kMaxReaders; ++reader) {
+		bool used = false;
+		if (readers_[reader].used.compare_exchange_strong(used, true)) return reader;
+	}
+	return kNoReader;
+}
+
+void USPCUpdate::RemoveReader(const uint32_t reader) {
+	readers_[reader].epoch.store(0);
+	readers_[reader].used.store(false);
+}
+
+// by vertex id, on the last published labels
+std::pair<uint32_t, uint64_t> USPCUpdate::SnapshotCount(uint32_t reader, uint32_t v1, uint32_t v2) const {
+	std::atomic<uint64_t>& pin = readers_[reader].epoch;
+	pin.store(epoch_.load());
+	const LabelSnapshot& snap = *snap_.load();
+	const auto res = CountLabels(snap[v1], snap[v2]);
+	pin.store(0);
+	return res;
+}
+
+/*
+*************************
+**** Inverted labels ****
+*************************
+*/
+
+void USPCUpdate::EnableInverted() {
+	inv_.assign(n_, std::vector<uint32_t>());
+	for (uint32_t v = 0; v < n_; ++v) {
+		for (size_t i = 0; i < cL_[v].size(); ++i) {
+			if (!cL_[v].IsGap(i)) inv_[LEExtractV(cL_[v][i])].push_back(v);
+		}
+	}
+	inverted_ = true;
+}
+
+void USPCUpdate::InvRemove(const uint32_t hub, const uint32_t v) {
+	if (!inverted_) return;
+	auto& list = inv_[hub];
+	auto it = std::find(list.begin(), list.end(), v);
+	ASSERT(it != list.end());
+	*it = list.back();
+	list.pop_back();
+}
+
+std::vector<uint32_t> USPCUpdate::CoveredID(const uint32_t v) const {
+	ASSERT(inverted_);
+	std::vector<uint32_t> covered;
+	for (const auto r : inv_[rank_[v]]) covered.push_back(order_[r]);
+	return covered;
+}
+
 /*
 **************************
 ****Incremental update****
@@ -675,42 +2218,72 @@ std::pair<uint32_t, uint64_t> USPCUpdate::Count(uint32_t v1, uint32_t v2) const
 
 // incremental update
 std::tuple<uint32_t, size_t, uint32_t, size_t, uint32_t, uint32_t, uint32_t> USPCUpdate::Inc_SPC(uint32_t a, uint32_t b) {
+	const uint32_t id_a = a, id_b = b;
+	a = rank_[a]; b = rank_[b];
+	const bool join = LEExtractV(cL_[a][0]) != LEExtractV(cL_[b][0]);
 	G_[a].push_back(b);
 	G_[b].push_back(a);
 
-	size_t aff_size = cL_[a].size() + cL_[b].size();
+	// joining an isolated vertex x to y: x sits one step behind y, so its
+	// label is the part of y's label ranked above x with distances + 1, and
+	// only x itself, as a hub, has a BFS to run
+	if (join && (G_[a].size() == 1 || G_[b].size() == 1)) {
+		const uint32_t x = G_[a].size() == 1 ? a : b;
+		const uint32_t y = x == a ? b : a;
+		std::vector<LabelEntry> Lx;
+		for (const auto e : cL_[y].Entries()) {
+			if (LEExtractV(e) >= x) break;
+			Lx.push_back(LEMerge(LEExtractV(e), LEExtractD(e) + 1, LEExtractC(e)));
+			InvAdd(LEExtractV(e), x);
+		}
+		uint32_t new_ = Lx.size();
+		Lx.push_back(LEMerge(x, 0, 1));
+		cL_[x].Assign(std::move(Lx));
+		Dirty(x);
+
+		uint32_t renew_c = 0, renew_d = 0;
+		if (x < y) {
+			auto res = Inc_BFS(x, y, 1, 1);
+			renew_c = std::get<0>(res); renew_d = std::get<1>(res); new_ += std::get<2>(res);
+		}
+		return std::make_tuple(id_a, cL_[a].num_entries(), id_b, cL_[b].num_entries(), renew_c, renew_d, new_);
+	}
+
+	const auto La = cL_[a].Entries();
+	const auto Lb = cL_[b].Entries();
+	size_t aff_size = La.size() + Lb.size();
 	std::vector<LabelEntry> aff_Labels;
 	std::vector<int> aff_ab(aff_size, -1);
 
 	size_t aL = 0, bL = 0;
-	while (aL < cL_[a].size() && bL < cL_[b].size()) {
-		auto aH = LEExtractV(cL_[a][aL]);
-		auto bH = LEExtractV(cL_[b][bL]);
-		if (rank_[aH] == rank_[bH]) {
-			aff_Labels.push_back(cL_[a][aL]);
+	while (aL < La.size() && bL < Lb.size()) {
+		auto aH = LEExtractV(La[aL]);
+		auto bH = LEExtractV(Lb[bL]);
+		if (aH == bH) {
+			aff_Labels.push_back(La[aL]);
 			aff_ab[aL+bL] = 0;
 			++aL;
-			aff_Labels.push_back(cL_[b][bL]);
+			aff_Labels.push_back(Lb[bL]);
 			aff_ab[aL+bL] = 1;
 			++bL;
-		} else if (rank_[aH] < rank_[bH]) {
-			aff_Labels.push_back(cL_[a][aL]);
+		} else if (aH < bH) {
+			aff_Labels.push_back(La[aL]);
 			aff_ab[aL+bL] = 0;
 			++aL;
 		} else {
-			aff_Labels.push_back(cL_[b][bL]);
+			aff_Labels.push_back(Lb[bL]);
 			aff_ab[aL+bL] = 1;
 			++bL;
 		}
 	}
 
-	while (aL < cL_[a].size()) {
-		aff_Labels.push_back(cL_[a][aL]);
+	while (aL < La.size()) {
+		aff_Labels.push_back(La[aL]);
 		aff_ab[aL+bL] = 0;
 		++aL;
 	}
-	while (bL < cL_[b].size()) {
-		aff_Labels.push_back(cL_[b][bL]);
+	while (bL < Lb.size()) {
+		aff_Labels.push_back(Lb[bL]);
 		aff_ab[aL+bL] = 1;
 		++bL;
 	}
@@ -719,35 +2292,118 @@ std::tuple<uint32_t, size_t, uint32_t, size_t, uint32_t, uint32_t, uint32_t> USP
     uint32_t renew_d = 0;
 	uint32_t new_ = 0;
 
+	// one resumed BFS per affected label, in hub order
+	std::vector<IncSeed> seeds;
+	std::vector<std::pair<size_t, size_t>> groups;
 	for (size_t i = 0; i < aff_size; ++i) {
-		if (aff_ab[i] == 0 && rank_[LEExtractV(aff_Labels[i])] < rank_[b]) {
-			auto ab_ = Inc_BFS(LEExtractV(aff_Labels[i]), b, LEExtractD(aff_Labels[i])+1, LEExtractC(aff_Labels[i]));
-			renew_c += std::get<0>(ab_); renew_d += std::get<1>(ab_); new_ += std::get<2>(ab_);
-		} else if (aff_ab[i] == 1 && rank_[LEExtractV(aff_Labels[i])] < rank_[a]) {
-			auto ba_ = Inc_BFS(LEExtractV(aff_Labels[i]), a, LEExtractD(aff_Labels[i])+1, LEExtractC(aff_Labels[i]));
-			renew_c += std::get<0>(ba_); renew_d += std::get<1>(ba_); new_ += std::get<2>(ba_);
+		if (aff_ab[i] == 0 && LEExtractV(aff_Labels[i]) < b) {
+			seeds.push_back({LEExtractV(aff_Labels[i]), b, LEExtractD(aff_Labels[i])+1, LEExtractC(aff_Labels[i])});
+		} else if (aff_ab[i] == 1 && LEExtractV(aff_Labels[i]) < a) {
+			seeds.push_back({LEExtractV(aff_Labels[i]), a, LEExtractD(aff_Labels[i])+1, LEExtractC(aff_Labels[i])});
+		} else {
+			continue;
+		}
+		groups.push_back(std::make_pair(seeds.size() - 1, seeds.size()));
+	}
+	std::tie(renew_c, renew_d, new_) = Inc_hubs(seeds, groups);
+
+    return std::make_tuple(id_a, cL_[a].num_entries(), id_b, cL_[b].num_entries(), renew_c, renew_d, new_);
+}
+ 
+// batch incremental update
+std::tuple<uint32_t, uint32_t, uint32_t> USPCUpdate::Inc_SPC_Batch(const std::vector<std::pair<uint32_t, uint32_t>>& edges) {
+	// every edge goes in first, so a resumed BFS can cross any of them
+	for (const auto& e : edges) {
+		const uint32_t a = rank_[e.first], b = rank_[e.second];
+		G_[a].push_back(b);
+		G_[b].push_back(a);
+	}
+
+	// seeds from the labels before the batch; a hub only changes its own
+	// entries, so they stay valid until the hub's turn
+	std::vector<IncSeed> seeds;
+	for (const auto& e : edges) {
+		const uint32_t a = rank_[e.first], b = rank_[e.second];
+		for (size_t i = 0; i < cL_[a].size(); ++i) {
+			const LabelEntry l = cL_[a][i];
+			if (cL_[a].IsGap(i) || LEExtractV(l) >= b) continue;
+			seeds.push_back({LEExtractV(l), b, LEExtractD(l) + 1, LEExtractC(l)});
+		}
+		for (size_t i = 0; i < cL_[b].size(); ++i) {
+			const LabelEntry l = cL_[b][i];
+			if (cL_[b].IsGap(i) || LEExtractV(l) >= a) continue;
+			seeds.push_back({LEExtractV(l), a, LEExtractD(l) + 1, LEExtractC(l)});
+		}
+	}
+	std::sort(seeds.begin(), seeds.end(), [](const IncSeed& s1, const IncSeed& s2) {
+		return s1.hub < s2.hub || (s1.hub == s2.hub && s1.d < s2.d);
+	});
+
+	std::vector<std::pair<size_t, size_t>> groups;
+	for (size_t i = 0, j = 0; i < seeds.size(); i = j) {
+		while (j < seeds.size() && seeds[j].hub == seeds[i].hub) ++j;
+		groups.push_back(std::make_pair(i, j));
+	}
+	return Inc_hubs(seeds, groups);
+}
+
+// Inc_BFS for every group of seeds, in hub order; see Repair_hubs
+std::tuple<uint32_t, uint32_t, uint32_t> USPCUpdate::Inc_hubs(const std::vector<IncSeed>& seeds,
+	const std::vector<std::pair<size_t, size_t>>& groups) {
+	uint32_t renew_c = 0, renew_d = 0, new_ = 0;
+	if (threads_ == 1) {
+		for (const auto& g : groups) {
+			auto res = Inc_BFS(seeds.data() + g.first, g.second - g.first);
+			renew_c += std::get<0>(res); renew_d += std::get<1>(res); new_ += std::get<2>(res);
 		}
+		return std::make_tuple(renew_c, renew_d, new_);
 	}
 
-    return std::make_tuple(a, cL_[a].size(), b, cL_[b].size(), renew_c, renew_d, new_);
+	auto res = Run_waves(groups.size(),
+		[&](const size_t k) { return seeds[groups[k].first].hub; },
+		[&](const size_t k, const int t, HubRepair& rep) {
+			const IncSeed* first = seeds.data() + groups[k].first;
+			const size_t num = groups[k].second - groups[k].first;
+			if (t < 0) Search_inc(first, num, ws_, hash_dist_, rep);
+			else Search_inc(first, num, tws_[t], thash_dist_[t], rep);
+		});
+	return std::make_tuple(std::get<0>(res), std::get<1>(res), std::get<2>(res));
 }
  
 // process of incremental update
 std::tuple<uint32_t, uint32_t, uint32_t> USPCUpdate::Inc_BFS(uint32_t hub, uint32_t ab, uint32_t d, uint64_t c) {
-	uint32_t num_add = 0;
-	uint32_t num_renewc = 0;
-    uint32_t num_renewd = 0;
-	std::vector<uint32_t> D(n_, UINT32_MAX);
-	std::vector<uint64_t> C(n_, 0);
-	std::vector<uint32_t> hash_dist(n_, UINT32_MAX);
-	std::queue<uint32_t> Q;
-	Q.push(ab);
-	D[ab] = d; C[ab] = c;
+	const IncSeed seed = {hub, ab, d, c};
+	return Inc_BFS(&seed, 1);
+}
+
+// resumed BFS from the seeds of one hub; a seed joins the queue once the
+// BFS reaches its distance, so levels are still visited in order
+std::tuple<uint32_t, uint32_t, uint32_t> USPCUpdate::Inc_BFS(const IncSeed* seeds, const size_t num) {
+	Search_inc(seeds, num, ws_, hash_dist_, repair_);
+	Apply_hub(seeds[0].hub, repair_);
+	return std::make_tuple(repair_.renew_C, repair_.renew_D, repair_.insert);
+}
+
+void USPCUpdate::Search_inc(const IncSeed* seeds, const size_t num, BFSWorkspace& ws,
+	std::vector<uint32_t>& hash_dist, HubRepair& rep) const {
+	const uint32_t hub = seeds[0].hub;
+	rep.writes.clear(); rep.erases.clear();
+	rep.renew_C = 0; rep.renew_D = 0; rep.insert = 0; rep.remove = 0;
+	auto& D = ws.D;
+	auto& C = ws.C;
+	size_t next = 0;
 
 	for (const auto e : cL_[hub]) hash_dist[LEExtractV(e)] = LEExtractD(e);
 
-	while (!Q.empty()) {
-		auto v = Q.front(); Q.pop();
+	while (!ws.Empty() || next < num) {
+		const uint32_t level = ws.Empty() ? seeds[next].d : D[ws.Q[ws.head]];
+		for (; next < num && seeds[next].d <= level; ++next) {
+			const IncSeed& s = seeds[next];
+			if (D[s.v] == UINT32_MAX) ws.Push(s.v, s.d, s.c);
+			else if (D[s.v] == s.d) C[s.v] += s.c;
+		}
+		if (ws.Empty()) continue; // every seed so far was already reached closer
+		auto v = ws.Pop();
 		auto previous = Distance(hash_dist, cL_[v], hub);
 
 		uint64_t CC = C[v];
@@ -758,54 +2414,108 @@ std::tuple<uint32_t, uint32_t, uint32_t> USPCUpdate::Inc_BFS(uint32_t hub, uint3
 		if (LEExtractV(cL_[v][previous.second]) == hub) {
 
             if (LEExtractD(cL_[v][previous.second]) == D[v]) {
-                num_renewc += 1;
+                rep.renew_C += 1;
             } else {
-                num_renewd += 1;
+                rep.renew_D += 1;
             }
 
-			cL_[v][previous.second] = LEMerge(hub,D[v],CC);
-
 		} else {
-			cL_[v].emplace(cL_[v].begin() + previous.second, LEMerge(hub,D[v],CC));
-			num_add += 1;
+			rep.insert += 1;
 		}
+		rep.writes.push_back(std::make_pair(v, LEMerge(hub,D[v],CC)));
 
 		for (auto nbr:G_[v]) {
-			if (rank_[nbr] <= rank_[hub]) continue;
+			if (nbr <= hub) continue;
 			if (D[nbr] == UINT32_MAX) {
-				D[nbr] = D[v] + 1; C[nbr] = C[v];
-				Q.push(nbr);
+				ws.Push(nbr, D[v] + 1, C[v]);
 			} else if (D[nbr] == D[v] + 1) {
 				C[nbr] += C[v];
 			}
 		}
 	} // while
 
-	return std::make_tuple(num_renewc,num_renewd,num_add);
+	// clear, cL_[hub] is not changed by the bfs (only lower ranks are visited)
+	ws.Reset();
+	for (const auto e : cL_[hub]) hash_dist[LEExtractV(e)] = UINT32_MAX;
+}
+
+// dense copy of the label of v in hash_dist_/hash_count_, so that labels
+// can be probed against it in one pass; counts skip the gaps
+void USPCUpdate::LoadDense(const uint32_t v) {
+	for (size_t i = 0; i < cL_[v].size(); ++i) {
+		if (cL_[v].IsGap(i)) continue;
+		hash_dist_[LEExtractV(cL_[v][i])] = LEExtractD(cL_[v][i]);
+		hash_count_[LEExtractV(cL_[v][i])] = LEExtractC(cL_[v][i]);
+	}
+}
+
+void USPCUpdate::UnloadDense(const uint32_t v) {
+	for (const auto e : cL_[v]) {
+		hash_dist_[LEExtractV(e)] = UINT32_MAX;
+		hash_count_[LEExtractV(e)] = 0;
+	}
+}
+
+// Count against a dense label; UINT32_MAX if there is no common hub
+std::pair<uint32_t, uint64_t> USPCUpdate::ProbeCount(const std::vector<uint32_t>& dLu,
+	const std::vector<uint64_t>& cLu, const GappedLabel& dLv) const {
+	uint32_t sp_d = UINT32_MAX;
+	uint64_t sp_c = 0;
+	for (const auto e : dLv) {
+		const uint32_t w = LEExtractV(e);
+		if (dLu[w] == UINT32_MAX) continue;
+		const uint32_t d = dLu[w] + LEExtractD(e);
+		if (d < sp_d) {
+			sp_d = d;
+			sp_c = cLu[w] * LEExtractC(e);
+		} else if (d == sp_d) {
+			sp_c += cLu[w] * LEExtractC(e);
+		}
+	}
+	return std::make_pair(sp_d, sp_c);
+}
+
+// Query_Search against the dense label of hub: the distance over the hubs
+// ranked above hub, then the distance, count and slot of the entry of hub
+// in dLv, or UINT32_MAX, 0 and the slot it would be inserted at
+std::tuple<uint32_t, uint32_t, uint64_t, size_t> USPCUpdate::Probe(const std::vector<uint32_t>& dLu,
+	const GappedLabel& dLv, uint32_t hub) const {
+	uint32_t d = UINT32_MAX;
+	size_t pos = 0;
+	for (; pos < dLv.size(); ++pos) {
+		const uint32_t w = LEExtractV(dLv[pos]);
+		if (w >= hub) break;
+		if (dLu[w] == UINT32_MAX) continue;
+		const uint32_t dd = dLu[w] + LEExtractD(dLv[pos]);
+		if (dd < d) d = dd;
+	}
+	if (pos < dLv.size() && LEExtractV(dLv[pos]) == hub)
+		return std::make_tuple(d, LEExtractD(dLv[pos]), LEExtractC(dLv[pos]), pos);
+	return std::make_tuple(d, UINT32_MAX, 0, pos);
 }
 
 // Calculate distance and also return the position of hub
 std::pair<uint32_t, size_t> USPCUpdate::Distance(const std::vector<uint32_t>& dLu,
-	const std::vector<LabelEntry>& dLv, uint32_t hub) const {
+	const GappedLabel& dLv, uint32_t hub) const {
 	size_t pos = 0;
 	uint64_t d = UINT64_MAX;
 	for (pos = 0; pos < dLv.size(); ++pos) {
 		auto v = LEExtractV(dLv[pos]);
-		if (rank_[v] > rank_[hub]) break;
+		if (v > hub) break;
 
 		if (dLu[v] == UINT32_MAX) continue;
 
 		auto dd = dLu[v] + LEExtractD(dLv[pos]);
 		if (dd < d) d = dd;
 
-		if (rank_[v] == rank_[hub]) break;
+		if (v == hub) break;
 	}
 	return std::make_pair(d, pos);
 }
  
 // Fast calculate distance
 uint32_t USPCUpdate::FastDistance(const std::vector<uint32_t>& dLu,
-	const std::vector<LabelEntry>& dLv) const {
+	const GappedLabel& dLv) const {
 		uint32_t d = UINT32_MAX;
 		for (const auto e : dLv) {
 			const uint32_t v = LEExtractV(e);
@@ -819,7 +2529,7 @@ uint32_t USPCUpdate::FastDistance(const std::vector<uint32_t>& dLu,
 
 // Fast calculate distance and counting
 std::pair<uint32_t, uint32_t> USPCUpdate::FastDistanceCount(const std::vector<std::pair<uint32_t, uint32_t>>& dLu,
-	const std::vector<LabelEntry>& dLv) const {
+	const GappedLabel& dLv) const {
 		uint32_t d = UINT32_MAX;
 		uint32_t c = 0;
 		for (const auto e : dLv) {
@@ -843,108 +2553,115 @@ std::pair<uint32_t, uint32_t> USPCUpdate::FastDistanceCount(const std::vector<st
 
 std::tuple<uint32_t,uint32_t,size_t,size_t,size_t,size_t,uint32_t,uint32_t,uint32_t,uint32_t> 
 USPCUpdate::Dec_SPC(uint32_t a, uint32_t b) {
+	a = rank_[a]; b = rank_[b];
 
 	std::cout << "Degree: " << G_[a].size() << " - " << G_[b].size() << "\n";
 
     const auto start = std::chrono::steady_clock::now();
 
-	std::vector<int> hubList_a(n_, 0);
-	std::vector<int> hubList_b(n_, 0);
+	// a bridge splits its component: labels within either side keep their
+	// shortest paths, those across the cut go, and no hub needs repairing
+	{
+		std::vector<uint32_t> Q[2];
+		const int s = Bridge_side(a, b, Q);
+		if (s >= 0) return std::make_tuple(a, b, 0, 0, 0, 0, 0, 0, 0, Cut_bridge(a, b, Q[s], s));
+		aff_a_.Reset();
+	}
+
+	auto& hubList_a = hub_a_.F;
+	auto& hubList_b = hub_b_.F;
 
 	for (auto cL_a:cL_[a]) {
-		hubList_a[LEExtractV(cL_a)] = 1;
+		hub_a_.Set(LEExtractV(cL_a), 1);
 	}
 
 	for (auto cL_b:cL_[b]) {
-		hubList_b[LEExtractV(cL_b)] = 1;
+		hub_b_.Set(LEExtractV(cL_b), 1);
 	}
 
-	int recA = 0, recB = 0;
-	std::vector<int> Aff_a_flag(n_, 0); // -1 for receriver, 0 for unkown, 1 for affected
-	std::vector<int> Aff_b_flag(n_, 0);
+	auto& Aff_a_flag = aff_a_.F; // -1 for receriver, 0 for unkown, 1 for affected
+	auto& Aff_b_flag = aff_b_.F;
 	std::vector<uint32_t> Aff_a; // store affected A
 	std::vector<uint32_t> Aff_b;
 	std::vector<uint32_t> Rec_a; // store receiver A
 	std::vector<uint32_t> Rec_b;
 
-	// Find Affected A
-	std::vector<uint32_t> Da(n_, UINT32_MAX);
-	std::vector<uint32_t> Ca(n_, 0);
-	Da[a] = 0; Ca[a] = 1;
+	// Find Affected A, probing the label of b
+	auto& Da = ws_.D;
+	auto& Ca = ws_.C;
+	LoadDense(b);
+	ws_.Push(a, 0, 1);
 
-	std::queue<uint32_t> Qa({a});
-
-	while (!Qa.empty()) {
+	while (!ws_.Empty()) {
         
         auto current = std::chrono::steady_clock::now();
 
-		auto u = Qa.front(); Qa.pop();
-		auto dc_u_b = Count(u, b);
+		auto u = ws_.Pop();
+		auto dc_u_b = ProbeCount(hash_dist_, hash_count_, cL_[u]);
 
 		if (Da[u] + 1 != dc_u_b.first) continue;
 
 		if (Ca[u] < dc_u_b.second && (hubList_a[u] == 0 || hubList_b[u] == 0)) {
 
-			Aff_a_flag[rank_[u]] = -1; 
+			aff_a_.Set(u, -1);
 			Rec_a.push_back(u);
 
 		} else {
 
 			// else, an affected, both sender and receriver
-			Aff_a_flag[rank_[u]] = 1;
-			Aff_a.push_back(rank_[u]);
+			aff_a_.Set(u, 1);
+			Aff_a.push_back(u);
 
 		}
 
 		for (auto nbr:G_[u]) {
 			if (Da[nbr] == UINT32_MAX) {
-				Da[nbr] = Da[u] + 1;
-				Ca[nbr] = Ca[u];
-				Qa.push(nbr);
+				ws_.Push(nbr, Da[u] + 1, Ca[u]);
 			} else if (Da[nbr] == Da[u] + 1) {
 				Ca[nbr] += Ca[u];
 			}
 		}
 	}
+	ws_.Reset();
+	UnloadDense(b);
 
-	// Find Affected B
-	std::vector<uint32_t> Db(n_, UINT32_MAX);
-	std::vector<uint32_t> Cb(n_, 0);
-	Db[b] = 0; Cb[b] = 1;
-
-	std::queue<uint32_t> Qb({b});
+	// Find Affected B, probing the label of a
+	auto& Db = ws_.D;
+	auto& Cb = ws_.C;
+	LoadDense(a);
+	ws_.Push(b, 0, 1);
 
-	while (!Qb.empty()) {
+	while (!ws_.Empty()) {
 
         auto current = std::chrono::steady_clock::now();
 
-		auto u = Qb.front(); Qb.pop();
-		auto dc_u_a = Count(u, a);
+		auto u = ws_.Pop();
+		auto dc_u_a = ProbeCount(hash_dist_, hash_count_, cL_[u]);
 
 		if (Db[u] + 1 != dc_u_a.first) continue;
 
 		if (Cb[u] < dc_u_a.second && (hubList_a[u] == 0 || hubList_b[u] == 0)) {
 
-			Aff_b_flag[rank_[u]] = -1; 
+			aff_b_.Set(u, -1);
 			Rec_b.push_back(u);
 
 		} else {
 
-			Aff_b_flag[rank_[u]] = 1;
-			Aff_b.push_back(rank_[u]);
+			aff_b_.Set(u, 1);
+			Aff_b.push_back(u);
 
 		}
 
 		for (auto nbr:G_[u]) {
 			if (Db[nbr] == UINT32_MAX) {
-				Db[nbr] = Db[u] + 1;
-				Cb[nbr] = Cb[u];
-				Qb.push(nbr);
+				ws_.Push(nbr, Db[u] + 1, Cb[u]);
 			} else if (Db[nbr] == Db[u] + 1) {
 				Cb[nbr] += Cb[u];
 			}
 		}
 	}
+	ws_.Reset();
+	UnloadDense(a);
     
     uint32_t renew_C = 0, renew_D = 0, insert = 0, remove = 0;
 
@@ -953,7 +2670,9 @@ USPCUpdate::Dec_SPC(uint32_t a, uint32_t b) {
 
 	if (std::get<0>(fast_res) == 1) {
 
-		return std::make_tuple(rank_[a], rank_[b], Aff_a.size(), Aff_b.size(), Rec_a.size(), Rec_b.size(), 
+		hub_a_.Reset(); hub_b_.Reset();
+		aff_a_.Reset(); aff_b_.Reset();
+		return std::make_tuple(a, b, Aff_a.size(), Aff_b.size(), Rec_a.size(), Rec_b.size(), 
         std::get<1>(fast_res), std::get<2>(fast_res), std::get<3>(fast_res), std::get<4>(fast_res));
 
 	}
@@ -967,40 +2686,170 @@ USPCUpdate::Dec_SPC(uint32_t a, uint32_t b) {
 	std::sort(Aff_a.begin(), Aff_a.end());
 	std::sort(Aff_b.begin(), Aff_b.end());
 
+	// a hub of A writes the labels flagged in B and vice versa
+	std::vector<HubJob> jobs;
 	for (uint32_t ai = 0, bi = 0; ai < Aff_a.size() || bi < Aff_b.size(); ) {
 
-        auto current = std::chrono::steady_clock::now();
-
 		if (bi == Aff_b.size() || ((ai < Aff_a.size() && bi < Aff_b.size()) && (Aff_a[ai] < Aff_b[bi]))) {
 
-			// update hub order_[ai]
-			int is_hub = (hubList_a[order_[Aff_a[ai]]] == 1 && hubList_b[order_[Aff_a[ai]]] == 1) ? 1 : 0;
+			// update hub Aff_a[ai]
+			int is_hub = (hubList_a[Aff_a[ai]] == 1 && hubList_b[Aff_a[ai]] == 1) ? 1 : 0;
+			jobs.push_back({Aff_a[ai], &Aff_b_flag, &Aff_b, &Rec_b, is_hub});
+			++ai;
 
-			auto res_ = Update_hub(order_[Aff_a[ai]], Aff_b_flag, Aff_b, Rec_b, is_hub);
+		} else if (ai == Aff_a.size() || ((ai < Aff_a.size() && bi < Aff_b.size()) && (Aff_a[ai] > Aff_b[bi]))) {
 
-            renew_C += std::get<0>(res_); renew_D += std::get<1>(res_); 
-            insert += std::get<2>(res_); remove += std::get<3>(res_); 
+			//update hub Aff_b[bi]
+			int is_hub = (hubList_a[Aff_b[bi]] == 1 && hubList_b[Aff_b[bi]] == 1) ? 1 : 0;
+			jobs.push_back({Aff_b[bi], &Aff_a_flag, &Aff_a, &Rec_a, is_hub});
+			++bi;
 
-			++ai;
+		}
+		
+	}
+	std::tie(renew_C, renew_D, insert, remove) = Repair_hubs(jobs);
 
-		} else if (ai == Aff_a.size() || ((ai < Aff_a.size() && bi < Aff_b.size()) && (Aff_a[ai] > Aff_b[bi]))) {
+	hub_a_.Reset(); hub_b_.Reset();
+	aff_a_.Reset(); aff_b_.Reset();
+
+    return std::make_tuple(a, b, Aff_a.size(), Aff_b.size(), Rec_a.size(), Rec_b.size(), 
+    renew_C, renew_D, insert, remove);
+}
+
+// searches from a and b in turn over G_ without the edge (a, b), flagging
+// their sides 1 and 2 in aff_a_ and collecting them in Q[0] and Q[1].
+// Returns the side exhausted first, which is then the whole component of
+// its end once (a, b) is gone, so (a, b) is a bridge; -1 if the searches
+// meet. No bridge set is kept across updates: a bridge costs O(its smaller
+// side) and any other edge the two searches until they meet, which a short
+// cycle through (a, b) keeps small. aff_a_ stays set for the caller
+int USPCUpdate::Bridge_side(const uint32_t a, const uint32_t b, std::vector<uint32_t> (&Q)[2]) {
+	auto& side = aff_a_.F;
+	Q[0].assign(1, a); Q[1].assign(1, b);
+	size_t head[2] = {0, 0};
+	aff_a_.Set(a, 1); aff_a_.Set(b, 2);
+	for (int k = 0; ; k ^= 1) {
+		const uint32_t v = Q[k][head[k]++];
+		for (const auto nbr : G_[v]) {
+			if (v == (k == 0 ? a : b) && nbr == (k == 0 ? b : a)) continue;
+			if (side[nbr] == 0) {
+				aff_a_.Set(nbr, k + 1);
+				Q[k].push_back(nbr);
+			} else if (side[nbr] != k + 1) {
+				return -1;
+			}
+		}
+		if (head[k] == Q[k].size()) return k;
+	}
+}
 
-			//update hub order_[bi]
-			int is_hub = (hubList_a[order_[Aff_b[bi]]] == 1 && hubList_b[order_[Aff_b[bi]]] == 1) ? 1 : 0;
+// delete bridge (a, b) and every label entry across it, with S the side s
+// exhausted by Bridge_side (and aff_a_ still flagged); returns the # of
+// entries removed. Entries at S with a hub outside S are filtered out. An
+// entry (h, u) with h in S and u outside lies on a canonical path through
+// the far endpoint t, so h is in the label of t. Every vertex of that path
+// after t ranks below h and holds h too (h is the highest on a prefix of
+// it), so u is reached from t through holders of h
+uint32_t USPCUpdate::Cut_bridge(const uint32_t a, const uint32_t b,
+		const std::vector<uint32_t>& S, const int s) {
+	G_[a].erase(std::remove(G_[a].begin(), G_[a].end(), b), G_[a].end());
+	G_[b].erase(std::remove(G_[b].begin(), G_[b].end(), a), G_[b].end());
 
-			auto res_ = Update_hub(order_[Aff_b[bi]], Aff_a_flag, Aff_a, Rec_a, is_hub);
+	const auto& side = aff_a_.F; // 1 for the side of a, 2 for the side of b
+	const uint32_t t = (s == 0) ? b : a;
 
-            renew_C += std::get<0>(res_); renew_D += std::get<1>(res_); 
-            insert += std::get<2>(res_); remove += std::get<3>(res_); 
+	uint32_t removed = 0;
+	std::vector<uint32_t> cut_hubs;
+	for (const auto e : cL_[t]) {
+		if (side[LEExtractV(e)] == s + 1 && (cut_hubs.empty() || cut_hubs.back() != LEExtractV(e)))
+			cut_hubs.push_back(LEExtractV(e));
+	}
 
-			++bi;
+	for (const auto v : S) {
+		std::vector<LabelEntry> kept;
+		for (const auto e : cL_[v].Entries()) {
+			if (side[LEExtractV(e)] == s + 1) kept.push_back(e);
+			else InvRemove(LEExtractV(e), v);
+		}
+		if (kept.size() == cL_[v].num_entries()) continue;
+		removed += cL_[v].num_entries() - kept.size();
+		cL_[v].Assign(std::move(kept));
+		Dirty(v);
+	}
 
+	for (const auto h : cut_hubs) {
+		ws_.Push(t, 0, 0);
+		while (!ws_.Empty()) {
+			const uint32_t u = ws_.Pop();
+			auto& L = cL_[u];
+			size_t pos = 0;
+			while (pos < L.size() && LEExtractV(L[pos]) < h) ++pos;
+			if (pos == L.size() || LEExtractV(L[pos]) != h) continue;
+			L.Erase(pos);
+			InvRemove(h, u);
+			Dirty(u);
+			++removed;
+			for (const auto nbr : G_[u]) {
+				if (nbr > h && ws_.D[nbr] == UINT32_MAX) ws_.Push(nbr, 0, 0);
+			}
 		}
-		
+		ws_.Reset();
 	}
+	aff_a_.Reset();
 
-    return std::make_tuple(rank_[a], rank_[b], Aff_a.size(), Aff_b.size(), Rec_a.size(), Rec_b.size(), 
-    renew_C, renew_D, insert, remove);
+	return removed;
+}
+
+// batch decremental update: affected, renew_only_C, renew_D, insert, remove
+std::tuple<uint32_t, uint32_t, uint32_t, uint32_t, uint32_t>
+USPCUpdate::Dec_SPC_Batch(const std::vector<std::pair<uint32_t, uint32_t>>& edges) {
+	// a label (h, v) can only change if a shortest h-v path crosses a deleted
+	// edge, so h and v both lie in the union of the per-edge searches
+	std::vector<uint32_t> Aff;
+	for (const auto& e : edges) {
+		const uint32_t a = rank_[e.first], b = rank_[e.second];
+		Dec_Search(a, b, Aff);
+		Dec_Search(b, a, Aff);
+	}
+
+	for (const auto& e : edges) {
+		const uint32_t a = rank_[e.first], b = rank_[e.second];
+		G_[a].erase(std::remove(G_[a].begin(), G_[a].end(), b), G_[a].end());
+		G_[b].erase(std::remove(G_[b].begin(), G_[b].end(), a), G_[b].end());
+	}
+
+	// every vertex of the union may write and lose labels of every hub
+	uint32_t renew_C = 0, renew_D = 0, insert = 0, remove = 0;
+	const std::vector<uint32_t> no_recs;
+	std::sort(Aff.begin(), Aff.end());
+	std::vector<HubJob> jobs;
+	for (const auto hub : Aff) jobs.push_back({hub, &aff_a_.F, &Aff, &no_recs, 1});
+	std::tie(renew_C, renew_D, insert, remove) = Repair_hubs(jobs);
+	aff_a_.Reset();
+
+	return std::make_tuple(Aff.size(), renew_C, renew_D, insert, remove);
+}
+
+void USPCUpdate::Dec_Search(const uint32_t s, const uint32_t t, std::vector<uint32_t>& Aff) {
+	auto& D = ws_.D;
+	LoadDense(t);
+	ws_.Push(s, 0, 1);
+
+	while (!ws_.Empty()) {
+		auto u = ws_.Pop();
+		if (D[u] + 1 != ProbeCount(hash_dist_, hash_count_, cL_[u]).first) continue;
+
+		if (aff_a_.F[u] == 0) {
+			aff_a_.Set(u, 1);
+			Aff.push_back(u);
+		}
+
+		for (auto nbr:G_[u]) {
+			if (D[nbr] == UINT32_MAX) ws_.Push(nbr, D[u] + 1, 0);
+		}
+	}
+	ws_.Reset();
+	UnloadDense(t);
 }
 
 // Dec_Update: renew_only_C, renew_D, insert, remove
@@ -1008,32 +2857,43 @@ std::tuple<uint32_t, uint32_t, uint32_t, uint32_t> USPCUpdate::Update_hub(uint32
 const std::vector<int>& Aff_list, const std::vector<uint32_t>& Affs,
 const std::vector<uint32_t>& Recs, int is_hub) {
 
-    uint32_t renew_C = 0, renew_D = 0, insert = 0, remove = 0;
+	const HubJob job = {hub, &Aff_list, &Affs, &Recs, is_hub};
+	Search_hub(job, ws_, updated_, hash_dist_, repair_);
+	Apply_hub(hub, repair_);
 
-	std::vector<int> updated_list(n_, 0);
-	std::vector<uint32_t> D(n_, UINT32_MAX);
-	std::vector<uint32_t> C(n_, 0);
-	D[hub] = 0; C[hub] = 1;
+    return std::make_tuple(repair_.renew_C, repair_.renew_D, repair_.insert, repair_.remove);
+}
 
-	std::queue<uint32_t> Q({hub});
+void USPCUpdate::Search_hub(const HubJob& job, BFSWorkspace& ws, FlagWorkspace& updated,
+	std::vector<uint32_t>& hash_dist, HubRepair& rep) const {
 
-	while (!Q.empty()) {
-		auto v = Q.front(); Q.pop();
+	const uint32_t hub = job.hub;
+	const auto& Aff_list = *job.Aff_list;
+	rep.writes.clear(); rep.erases.clear();
+    rep.renew_C = 0; rep.renew_D = 0; rep.insert = 0; rep.remove = 0;
+
+	auto& updated_list = updated.F;
+	auto& D = ws.D;
+	auto& C = ws.C;
+	for (const auto e : cL_[hub]) hash_dist[LEExtractV(e)] = LEExtractD(e);
+	ws.Push(hub, 0, 1);
+
+	while (!ws.Empty()) {
+		auto v = ws.Pop();
 		
         if (v != hub) {
 
-			if (Aff_list[rank_[v]] == 0) {
+			auto dcp_soFar = Probe(hash_dist, cL_[v], hub);
+			auto d_over = std::get<0>(dcp_soFar);
+			auto d_h = std::get<1>(dcp_soFar);
+
+			if (Aff_list[v] == 0) {
 
-				auto dis_h_v = Query_Distance(hub, v);
+				auto dis_h_v = std::min(d_over, d_h); // hub is at distance 0 from itself
 				if (dis_h_v < D[v]) continue;
 
 			} else {
-				auto dcp_soFar = Query_Search(hub, v);
-				auto d_over = std::get<0>(dcp_soFar);
-				auto c_over = std::get<1>(dcp_soFar);
-				auto d_h = std::get<2>(dcp_soFar);
-				auto c_h = std::get<3>(dcp_soFar);
-				auto pos = std::get<4>(dcp_soFar);
+				auto c_h = std::get<2>(dcp_soFar);
 
 				if (D[v] > d_over) {
                     continue; // DIS PRUNER
@@ -1041,106 +2901,199 @@ const std::vector<uint32_t>& Recs, int is_hub) {
 
 				if (d_h == UINT32_MAX) {
 
-						cL_[v].insert(cL_[v].begin() + pos, LEMerge(hub, D[v], C[v]));
-                        ++insert;
-						updated_list[v] = 1;
+						rep.writes.push_back(std::make_pair(v, LEMerge(hub, D[v], C[v])));
+                        ++rep.insert;
+						updated.Set(v, 1);
 
 				} else {
 
 						if (d_h != D[v] || c_h != C[v]) {
 
-							cL_[v][pos] = LEMerge(hub, D[v], C[v]);
-							updated_list[v] = 1;
+							rep.writes.push_back(std::make_pair(v, LEMerge(hub, D[v], C[v])));
+							updated.Set(v, 1);
 
-                            if (d_h == D[v]) ++renew_C;
-                            else ++renew_D;
+                            if (d_h == D[v]) ++rep.renew_C;
+                            else ++rep.renew_D;
 
 						} else {
-							updated_list[v] = 1;
+							updated.Set(v, 1);
 						}
 				}
 			}
 		}
 
 		for (auto nbr:G_[v]) {
-			if (rank_[nbr] <= rank_[hub]) continue;
+			if (nbr <= hub) continue;
 			if (D[nbr] == UINT32_MAX) {
-				D[nbr] = D[v] + 1;
-				C[nbr] = C[v];
-				Q.push(nbr);
+				ws.Push(nbr, D[v] + 1, C[v]);
 			} else if (D[nbr] == D[v] + 1) {
 				C[nbr] += C[v];
 			}
 		}
 	}
-
-	// if hub is the common hub of a, b, then there are potential erased labels
-	if (is_hub == 1) {
-		for (auto affV:Affs) {
-
-			if (affV <= rank_[hub]) continue;
-
-			auto cur_v = order_[affV];
-			if (updated_list[cur_v] == 0) {
-
-				for (size_t di = 0; di < cL_[cur_v].size(); ++di) {
-					if (LEExtractV(cL_[cur_v][di]) == hub) {
-
-						cL_[cur_v].erase(cL_[cur_v].begin() + di);
-						++remove;
-						updated_list[cur_v] = 1;
-
-						break;
-					}
+	ws.Reset();
+	for (const auto e : cL_[hub]) hash_dist[LEExtractV(e)] = UINT32_MAX;
+
+	// if hub is the common hub of a, b, then there are potential erased labels;
+	// the affected and receiver vertices are the ones flagged in Aff_list
+	if (job.is_hub == 1 && inverted_) {
+		for (const auto v : inv_[hub]) {
+			if (v <= hub || Aff_list[v] == 0 || updated_list[v] != 0) continue;
+			rep.erases.push_back(v);
+			++rep.remove;
+			updated.Set(v, 1);
+		}
+	} else if (job.is_hub == 1) {
+		for (const auto* list : {job.Affs, job.Recs}) {
+			for (auto affV:*list) {
+
+				if (affV <= hub || updated_list[affV] != 0) continue;
+
+				// slots stay sorted by hub, gaps included
+				const auto& L = cL_[affV];
+				const auto it = std::lower_bound(L.begin(), L.end(), hub,
+					[](const LabelEntry& e, const uint32_t h) { return LEExtractV(e) < h; });
+				if (it != L.end() && LEExtractV(*it) == hub) {
+					rep.erases.push_back(affV);
+					++rep.remove;
+					updated.Set(affV, 1);
 				}
 			}
 		}
+	}
+	updated.Reset();
+}
+
+// the entry of the hub in cL_[v] comes first among those not below it
+void USPCUpdate::Apply_hub(const uint32_t hub, const HubRepair& rep) {
+	for (const auto& w : rep.writes) {
+		auto& L = cL_[w.first];
+		size_t pos = 0;
+		while (pos < L.size() && LEExtractV(L[pos]) < hub) ++pos;
+		if (pos < L.size() && LEExtractV(L[pos]) == hub) {
+			L.Set(pos, w.second);
+		} else {
+			L.Insert(pos, w.second);
+			InvAdd(hub, w.first);
+		}
+		Dirty(w.first);
+	}
+	for (const auto v : rep.erases) {
+		auto& L = cL_[v];
+		size_t pos = 0;
+		while (LEExtractV(L[pos]) != hub) ++pos;
+		L.Erase(pos);
+		InvRemove(hub, v);
+		Dirty(v);
+	}
+}
 
-		for (auto recv:Recs) {
+std::tuple<uint32_t, uint32_t, uint32_t, uint32_t> USPCUpdate::Repair_hubs(const std::vector<HubJob>& jobs) {
+	if (threads_ == 1) {
+		uint32_t renew_C = 0, renew_D = 0, insert = 0, remove = 0;
+		for (const auto& job : jobs) {
+			auto res_ = Update_hub(job.hub, *job.Aff_list, *job.Affs, *job.Recs, job.is_hub);
+			renew_C += std::get<0>(res_); renew_D += std::get<1>(res_);
+			insert += std::get<2>(res_); remove += std::get<3>(res_);
+		}
+		return std::make_tuple(renew_C, renew_D, insert, remove);
+	}
 
-			if (rank_[recv] <= rank_[hub]) continue;
+	return Run_waves(jobs.size(),
+		[&](const size_t k) { return jobs[k].hub; },
+		[&](const size_t k, const int t, HubRepair& rep) {
+			if (t < 0) Search_hub(jobs[k], ws_, updated_, hash_dist_, rep);
+			else Search_hub(jobs[k], tws_[t], tupdated_[t], thash_dist_[t], rep);
+		});
+}
 
-			if (updated_list[recv] == 0) {
+// Jobs run in waves of consecutive hubs. A wave ends before a hub whose
+// label holds a hub of the wave, since its search would read entries the
+// wave is rewriting; the other entries it reads only change if its own label
+// does. The searches of a wave run in parallel and are applied in hub order;
+// a hub whose label was changed by an earlier hub of the wave is searched
+// again, so the result equals running the jobs one at a time.
+std::tuple<uint32_t, uint32_t, uint32_t, uint32_t> USPCUpdate::Run_waves(const size_t num,
+	const std::function<uint32_t(size_t)>& hub_of,
+	const std::function<void(size_t, int, HubRepair&)>& search) {
+	uint32_t renew_C = 0, renew_D = 0, insert = 0, remove = 0;
+
+	const size_t kMaxWave = 16 * threads_;
+	if (tws_.size() != static_cast<size_t>(threads_)) {
+		tws_.resize(threads_); tupdated_.resize(threads_); thash_dist_.resize(threads_);
+		for (auto& ws : tws_) ws.Init(n_);
+		for (auto& f : tupdated_) f.Init(n_);
+		for (auto& h : thash_dist_) h.assign(n_, UINT32_MAX);
+		trepair_.resize(kMaxWave);
+		wave_.Init(n_); written_.Init(n_);
+	}
 
-				for (size_t di = 0; di < cL_[recv].size(); ++di) {
-					if (LEExtractV(cL_[recv][di]) == hub) {
+	for (size_t i = 0, j = 0; i < num; i = j) {
+		for (; j < num && j - i < kMaxWave; ++j) {
+			bool depends = false;
+			for (const auto e : cL_[hub_of(j)]) {
+				if (wave_.F[LEExtractV(e)] != 0) { depends = true; break; }
+			}
+			if (depends) break;
+			wave_.Set(hub_of(j), 1);
+		}
+		wave_.Reset();
 
-						cL_[recv].erase(cL_[recv].begin() + di);
-						++remove;
-						updated_list[recv] = 1;
+		#pragma omp parallel for schedule(dynamic) num_threads(threads_) if (j - i > 1)
+		for (size_t k = i; k < j; ++k) {
+			search(k, omp_get_thread_num(), trepair_[k - i]);
+		}
 
-						break;
-					}
-				}
+		for (size_t k = i; k < j; ++k) {
+			const uint32_t hub = hub_of(k);
+			const HubRepair* rep = &trepair_[k - i];
+			if (written_.F[hub] != 0) {
+				search(k, -1, repair_);
+				rep = &repair_;
 			}
+			Apply_hub(hub, *rep);
+			renew_C += rep->renew_C; renew_D += rep->renew_D;
+			insert += rep->insert; remove += rep->remove;
+			for (const auto& w : rep->writes) written_.Set(w.first, 1);
+			for (const auto v : rep->erases) written_.Set(v, 1);
 		}
+		written_.Reset();
 	}
-
-    return std::make_tuple(renew_C, renew_D, insert, remove);
+	return std::make_tuple(renew_C, renew_D, insert, remove);
 }
 
 // Isolated vertex optimization
 std::tuple<int, uint32_t, uint32_t, uint32_t, uint32_t> USPCUpdate::Fast_update(uint32_t a, uint32_t b, 
 const std::vector<int>& Aff_list, const std::vector<uint32_t>& AffA, const std::vector<uint32_t>& AffB,
-const std::vector<uint32_t>& RecA, std::vector<uint32_t> RecB) {
+const std::vector<uint32_t>& RecA, const std::vector<uint32_t>& RecB) {
 	
 	// disconnect a node from the rest graph
 	if (RecA.size() == 0 && RecB.size() == 0) {
 
 		if (AffA.size() == 1 && G_[a].size() == 1) {
-			if (rank_[a] > rank_[b]) {
-				uint32_t erase_cnt = cL_[a].size() - 1;
-				std::vector <spc::LabelEntry>().swap(cL_[a]); 
-				cL_[a].push_back(LEMerge(a, 0, 1));
+			if (a > b) {
+				uint32_t erase_cnt = cL_[a].num_entries() - 1;
+				if (inverted_) {
+					for (const auto e : cL_[a].Entries()) {
+						if (LEExtractV(e) != a) InvRemove(LEExtractV(e), a);
+					}
+				}
+				cL_[a].Assign({LEMerge(a, 0, 1)});
+				Dirty(a);
 				return std::make_tuple(1,0,0,0,erase_cnt);
 			}
 
 		} else if (AffB.size() == 1 && G_[b].size() == 1) {
 
-			if (rank_[b] > rank_[a]) {
-				uint32_t erase_cnt = cL_[b].size() - 1;
-				std::vector <spc::LabelEntry>().swap(cL_[b]); 
-				cL_[b].push_back(LEMerge(b, 0, 1));
+			if (b > a) {
+				uint32_t erase_cnt = cL_[b].num_entries() - 1;
+				if (inverted_) {
+					for (const auto e : cL_[b].Entries()) {
+						if (LEExtractV(e) != b) InvRemove(LEExtractV(e), b);
+					}
+				}
+				cL_[b].Assign({LEMerge(b, 0, 1)});
+				Dirty(b);
 				return std::make_tuple(1,0,0,0,erase_cnt);
 			}
 
@@ -1150,7 +3103,110 @@ const std::vector<uint32_t>& RecA, std::vector<uint32_t> RecB) {
 	return std::make_tuple(0,0,0,0,0);
 }
 
-std::tuple<uint32_t, uint64_t, uint32_t, uint64_t, uint32_t> USPCUpdate::Query_Search(uint32_t h, uint32_t v) {
+/*
+**************************
+***** Vertex updates *****
+**************************
+*/
+
+// a new vertex takes the next id and the lowest rank: it holds only itself
+// and is nobody's hub, so every other label stays as it is. Its edges then
+// come in through Inc_SPC, where the join of an isolated vertex is cheap
+uint32_t USPCUpdate::AddVertex() {
+	const uint32_t v = n_;
+	NormalV(v);
+	++n_;
+	G_.emplace_back();
+	order_.push_back(v);
+	rank_.push_back(v);
+	cL_.emplace_back();
+	cL_[v].Assign({LEMerge(v, 0, 1)});
+
+	// workspaces, still clear between updates
+	ws_.Grow(n_);
+	hash_dist_.push_back(UINT32_MAX);
+	hash_count_.push_back(0);
+	hub_a_.Grow(n_); hub_b_.Grow(n_);
+	aff_a_.Grow(n_); aff_b_.Grow(n_);
+	updated_.Grow(n_);
+	for (auto& ws : tws_) ws.Grow(n_);
+	for (auto& f : tupdated_) f.Grow(n_);
+	for (auto& h : thash_dist_) h.push_back(UINT32_MAX);
+	wave_.Grow(n_); written_.Grow(n_);
+
+	if (inverted_) inv_.push_back({v});
+	if (snapshots_) dirty_.Grow(n_);
+	Dirty(v);
+	return v;
+}
+
+// all edges of v in one decremental step; v keeps its id and rank. A label
+// (h, w) of two other vertices changes only if a shortest h-w path crosses
+// v, and then h and w both reach a neighbor of v through v: the union of
+// Dec_Search(v, u) over the neighbors u covers them, without the far sides
+// Dec_SPC_Batch would add. Labels that hold v, or v's own, are just dropped
+std::tuple<uint32_t, uint32_t, uint32_t, uint32_t, uint32_t> USPCUpdate::RemoveVertex(const uint32_t v) {
+	const uint32_t r = rank_[v];
+	if (G_[r].empty()) return std::make_tuple(0, 0, 0, 0, 0);
+
+	std::vector<uint32_t> Aff;
+	for (const auto u : G_[r]) Dec_Search(r, u, Aff);
+
+	// the holders of hub r lie on shortest paths from r that rank below it,
+	// so they are reached from r through holders only
+	std::vector<uint32_t> holders;
+	if (inverted_) {
+		holders = inv_[r];
+	} else {
+		ws_.Push(r, 0, 0);
+		while (!ws_.Empty()) {
+			const uint32_t u = ws_.Pop();
+			holders.push_back(u);
+			for (const auto nbr : G_[u]) {
+				if (nbr <= r || ws_.D[nbr] != UINT32_MAX) continue;
+				const auto& L = cL_[nbr];
+				size_t pos = 0;
+				while (pos < L.size() && LEExtractV(L[pos]) < r) ++pos;
+				if (pos < L.size() && LEExtractV(L[pos]) == r) ws_.Push(nbr, ws_.D[u] + 1, 0);
+			}
+		}
+		ws_.Reset();
+	}
+	uint32_t remove = 0;
+	for (const auto w : holders) {
+		if (w == r) continue;
+		auto& L = cL_[w];
+		size_t pos = 0;
+		while (LEExtractV(L[pos]) != r) ++pos;
+		L.Erase(pos);
+		InvRemove(r, w);
+		Dirty(w);
+		++remove;
+	}
+	for (const auto e : cL_[r].Entries()) {
+		if (LEExtractV(e) != r) InvRemove(LEExtractV(e), r);
+	}
+	remove += cL_[r].num_entries() - 1;
+	cL_[r].Assign({LEMerge(r, 0, 1)});
+	Dirty(r);
+
+	for (const auto u : G_[r]) G_[u].erase(std::find(G_[u].begin(), G_[u].end(), r));
+	G_[r].clear();
+
+	uint32_t renew_C = 0, renew_D = 0, insert = 0, removed = 0;
+	const std::vector<uint32_t> no_recs;
+	std::sort(Aff.begin(), Aff.end());
+	std::vector<HubJob> jobs;
+	for (const auto hub : Aff) {
+		if (hub != r) jobs.push_back({hub, &aff_a_.F, &Aff, &no_recs, 1});
+	}
+	std::tie(renew_C, renew_D, insert, removed) = Repair_hubs(jobs);
+	aff_a_.Reset();
+
+	return std::make_tuple(Aff.size(), renew_C, renew_D, insert, remove + removed);
+}
+
+std::tuple<uint32_t, uint64_t, uint32_t, uint64_t, uint32_t> USPCUpdate::Query_Search(uint32_t h, uint32_t v) const {
 
 	size_t p1 = 0, p2 = 0;
 	uint32_t sp_d = UINT32_MAX;
@@ -1171,8 +3227,8 @@ std::tuple<uint32_t, uint64_t, uint32_t, uint64_t, uint32_t> USPCUpdate::Query_S
 			return std::make_tuple(sp_d, sp_c, hub_d, hub_c, hub_pos);
 		} 
 		
-		if (rank_[w1] < rank_[w2]) ++p1;
-		else if (rank_[w1] > rank_[w2]) ++p2;
+		if (w1 < w2) ++p1;
+		else if (w1 > w2) ++p2;
 		else {
 		const uint32_t d = LEExtractD(cL_[h][p1]) +
 			LEExtractD(cL_[v][p2]);
@@ -1193,16 +3249,16 @@ std::tuple<uint32_t, uint64_t, uint32_t, uint64_t, uint32_t> USPCUpdate::Query_S
 	return std::make_tuple(sp_d, sp_c, UINT32_MAX, 0, p2);
 }
 
-uint32_t USPCUpdate::Query_Distance(uint32_t hub, uint32_t v) {
+uint32_t USPCUpdate::Query_Distance(uint32_t hub, uint32_t v) const {
 	size_t p1 = 0, p2 = 0;
 	uint32_t sp_d = UINT32_MAX;
 
-	while (p1 < cL_[v].size() && p2 < cL_[hub].size()) {
+	while (p1 < cL_[hub].size() && p2 < cL_[v].size()) {
 		const uint32_t w1 = LEExtractV(cL_[hub][p1]);
 		const uint32_t w2 = LEExtractV(cL_[v][p2]);
 
-		if (rank_[w1] < rank_[w2]) ++p1;
-		else if (rank_[w1] > rank_[w2]) ++p2;
+		if (w1 < w2) ++p1;
+		else if (w1 > w2) ++p2;
 		else {
 			const uint32_t d = LEExtractD(cL_[hub][p1]) +
 				LEExtractD(cL_[v][p2]);
@@ -1,18 +1,146 @@
 #ifndef SPC_U_SPC_H_
 #define SPC_U_SPC_H_
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <functional>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 #include <set>
 #include <tuple>
 
 #include "macros.h"
+#include "two_layer_queue.h"
 #include "u_label.h"
 
 namespace spc {
+// n-sized BFS state (distance, count) that is cleared in time proportional to
+// the vertices it touched; the touched list doubles as the FIFO queue
+struct BFSWorkspace {
+    std::vector<uint32_t> D;
+    std::vector<uint64_t> C;
+    std::vector<uint32_t> Q;
+    size_t head = 0;
+
+    void Init(const uint32_t n) {
+        D.assign(n, UINT32_MAX); C.assign(n, 0);
+        Q.clear(); head = 0;
+    }
+    // room for vertices added since Init; must be clear
+    void Grow(const uint32_t n) { D.resize(n, UINT32_MAX); C.resize(n, 0); }
+    void Push(const uint32_t v, const uint32_t d, const uint64_t c) {
+        D[v] = d; C[v] = c; Q.push_back(v);
+    }
+    bool Empty() const { return head == Q.size(); }
+    uint32_t Pop() { return Q[head++]; }
+    void Reset() {
+        for (const uint32_t v : Q) { D[v] = UINT32_MAX; C[v] = 0; }
+        Q.clear(); head = 0;
+    }
+};
+
+// n-sized flag array that remembers which entries were set
+struct FlagWorkspace {
+    std::vector<int> F;
+    std::vector<uint32_t> touched;
+
+    void Init(const uint32_t n) { F.assign(n, 0); touched.clear(); }
+    void Grow(const uint32_t n) { F.resize(n, 0); }
+    void Set(const uint32_t i, const int f) {
+        if (0 == F[i]) touched.push_back(i);
+        F[i] = f;
+    }
+    void Reset() {
+        for (const uint32_t i : touched) F[i] = 0;
+        touched.clear();
+    }
+};
+
+// state of one bidirectional BFS (distance, count and level queue per
+// direction), cleared in time proportional to the vertices it touched
+struct BiBFSWorkspace {
+    std::vector<uint32_t> D[2];
+    std::vector<uint32_t> C[2];
+    std::vector<uint32_t> touched[2];
+    std::vector<TwoLayerQueue> Q;
+
+    void Init(const uint32_t n) {
+        for (int dir = 0; dir < 2; ++dir) {
+            D[dir].assign(n, UINT32_MAX); C[dir].assign(n, 0);
+            touched[dir].clear();
+        }
+        Q.assign(2, TwoLayerQueue(n));
+    }
+    void Visit(const int dir, const uint32_t v, const uint32_t d, const uint32_t c) {
+        if (UINT32_MAX == D[dir][v]) touched[dir].push_back(v);
+        D[dir][v] = d; C[dir][v] = c;
+    }
+    void Reset() {
+        for (int dir = 0; dir < 2; ++dir) {
+            for (const uint32_t v : touched[dir]) { D[dir][v] = UINT32_MAX; C[dir][v] = 0; }
+            touched[dir].clear();
+            Q[dir].clear();
+        }
+    }
+};
+
+// how a vertex of a folded index (USPCIndex::set_fold) reaches the labels,
+// by rank. Only twin representatives of the kernel are labelled; the
+// others borrow the label of the representative of their root.
+struct FoldEntry {
+    uint32_t root;    // kernel vertex its degree-1 tree hangs from, itself if in the kernel
+    uint32_t depth;   // distance to root
+    uint32_t parent;  // next vertex towards root, itself if in the kernel
+    uint32_t rep;     // twin representative of root
+    uint32_t mult;    // representative: size of its twin class
+    uint32_t twin_d;  // representative: distance between two twins, 1 (adjacent) or 2
+    uint64_t twin_c;  // representative: # of shortest paths between two twins
+};
+
+// header of a plain label file (IndexWrite), followed by n, the graph, the
+// labels and the order. entry_bits is kEntryBits of the build that wrote
+// it, so a build with another label entry layout rejects the file.
+struct LabelFileHeader {
+    static constexpr uint32_t kMagic = 0x4C435053; // "SPCL"
+    uint32_t magic;
+    uint32_t entry_bits;
+    uint32_t num_tree;        // trailing ranks that are core-tree tree vertices, 0 if flat
+};
+
+// query-ready index file (<label file>.q), written by u_index and u_update
+// and mapped read-only by u_query. After the header come the sections
+// order[n], rank[n], offsets[n + 1], entries[] and hubs[] (the FlatLabel
+// layout, labels already merged), each starting on a 64-byte boundary.
+// A folded index adds fold[n] (FoldEntry) at fold_pos. A compressed index
+// (USPCIndex::set_compress) has the CompressedLabel bytes at zlabels_pos
+// instead of entries[] and hubs[] (their positions are 0), and offsets[]
+// then holds byte offsets into them. Integers are stored in host byte
+// order. The checksum is taken over all bytes after the header.
+struct QueryIndexHeader {
+    static constexpr char kMagic[8] = {'D', 'S', 'P', 'C', 'Q', 'I', 'D', 'X'};
+    static constexpr uint32_t kVersion = 3;
+    static constexpr uint64_t kAlign = 64;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_bits;      // kNumVBits | kNumDBits << 8 | kNumCBits << 16, i.e. the layout
+    uint32_t n;
+    uint32_t num_tree;        // trailing ranks that are core-tree tree vertices, 0 if flat
+    uint64_t num_entries;
+    uint64_t order_pos;       // byte offsets of the sections
+    uint64_t rank_pos;
+    uint64_t offsets_pos;
+    uint64_t entries_pos;
+    uint64_t hubs_pos;
+    uint64_t file_bytes;
+    uint64_t checksum;
+    uint64_t fold_pos;        // 0 if the index is not folded
+    uint64_t zlabels_pos;     // 0 if the index is not compressed
+};
+
 class USPC {
     public:
 
@@ -27,9 +155,25 @@ class USPC {
             }
         }
 
+        // write the query-ready index; size(r) is the # of entries of rank r
+        // and label(r, L) fills L with its merged entries
+        uint64_t QueryIndexWrite(const std::string& filename,
+                const std::function<size_t(uint32_t)>& size,
+                const std::function<void(uint32_t, std::vector<LabelEntry>&)>& label) const;
+
+        // a folded label file has fold_ and then [n_][kFoldMagic] there
+        static constexpr uint32_t kFoldMagic = 0x58494446; // "FDIX"
+
         uint32_t n_;
-        Graph G_;
-        Label dL_, cL_;
+        // core-tree index (USPCIndex::set_tree_width): the last num_tree_
+        // ranks are tree vertices whose labels hold tree hubs and interface
+        // entries instead of 2-hop entries; 0 for a flat index
+        uint32_t num_tree_ = 0;
+        // by rank, empty unless the index is folded
+        std::vector<FoldEntry> fold_;
+        // QueryIndexWrite writes compressed labels; flat indexes only
+        bool compress_ = false;
+        Graph G_; // in rank space, as are the labels (vertex r is order_[r])
     
         std::vector<uint32_t> order_;
         std::vector<uint32_t> rank_;
@@ -51,6 +195,10 @@ class USPCIndex final: private USPC {
     public:
         enum class OrderScheme {
             kDegree,
+            kBetweenness, // sampled betweenness, ties by degree
+            kCore,        // reverse degeneracy (k-core peeling) order
+            kHybrid,      // core number, ties by degree
+            kFile,        // read from the file of set_order_file
             kInvalid
         };
 
@@ -61,41 +209,184 @@ class USPCIndex final: private USPC {
         void BuildIndex(const Graph& const_graph);
         void IndexMerge();
         uint64_t IndexWrite(const std::string& filename);
+        uint64_t QueryIndexWrite(const std::string& filename) const;
 
         void set_os(const OrderScheme os) { os_ = os; }
+        void set_threads(const uint32_t threads) { num_threads_ = threads; }
+        // BFS sources of kBetweenness
+        void set_samples(const uint32_t samples) { num_samples_ = samples; }
+        // "n" and then the n vertex ids, highest rank first
+        void set_order_file(const std::string& filename) { order_file_ = filename; }
+        // core-tree index: vertices of degree <= w are eliminated (min degree
+        // first) into a tree decomposition, and 2-hop labels are built on the
+        // remaining core only; 0 builds the flat index
+        void set_tree_width(const uint32_t w) { tree_width_ = w; }
+        // # of vertices eliminated into the tree
+        uint32_t num_tree() const { return num_tree_; }
+        // fold degree-1 trees onto the vertex they hang from and twins
+        // (same neighbours) onto one representative before labelling
+        void set_fold(const bool fold) { fold_graph_ = fold; }
+        // write label_file.q with compressed labels (CompressedLabel)
+        void set_compress(const bool compress) { compress_ = compress; }
+        // # of vertices with a label of their own
+        uint32_t num_labelled() const;
 
     private:
         uint32_t Distance(const std::vector<uint32_t>& dLu,
                         const std::vector<LabelEntry>& dLv) const;
 
+        void BuildIndexParallel();
+
+        // (neighbour, distance, count) edges of a vertex, each standing for
+        // the shortest paths through vertices eliminated before it
+        using Bag = std::vector<std::tuple<uint32_t, uint32_t, uint64_t>>;
+        // min degree elimination up to tree_width_; moves the eliminated
+        // vertices to the lowest ranks of order_. bags[v] of a tree vertex
+        // is its bag, of a core vertex its edges in the contracted core graph
+        void Eliminate(std::vector<Bag>& bags);
+        // labels of the core-tree index, bags in rank space
+        void BuildCoreTree(const std::vector<Bag>& bags);
+
+        // fills fold_ and reorders order_; see u_spc.cc
+        void Fold();
+        // a count as it leaves v for a BFS of another hub: paths through the
+        // twins of v count as well
+        uint32_t Through(const uint32_t v, const uint32_t c) const {
+            if (fold_.empty()) return c;
+            return std::min<uint64_t>(static_cast<uint64_t>(c) * fold_[v].mult, kUBC);
+        }
+
+        Label dL_, cL_;
+
 
         void DegreeOrder(const Graph& graph);
+        void BetweennessOrder(const Graph& graph);
+        void CoreOrder(const Graph& graph);
+        void HybridOrder(const Graph& graph);
+        void FileOrder(const Graph& graph);
         void InvalidOrder(const Graph&) {
             ASSERT_INFO(false, "invalid ordering");
         }
+        // core numbers, and the vertices in the order they are peeled
+        void Peel(const Graph& graph, std::vector<uint32_t>& core,
+                  std::vector<uint32_t>& peeled) const;
 
         std::map<OrderScheme, void (USPCIndex::*)(const Graph&)> of_ = {
-            {OrderScheme::kDegree,  &USPCIndex::DegreeOrder},
-            {OrderScheme::kInvalid, &USPCIndex::InvalidOrder}
+            {OrderScheme::kDegree,      &USPCIndex::DegreeOrder},
+            {OrderScheme::kBetweenness, &USPCIndex::BetweennessOrder},
+            {OrderScheme::kCore,        &USPCIndex::CoreOrder},
+            {OrderScheme::kHybrid,      &USPCIndex::HybridOrder},
+            {OrderScheme::kFile,        &USPCIndex::FileOrder},
+            {OrderScheme::kInvalid,     &USPCIndex::InvalidOrder}
         };
 
         OrderScheme os_ = OrderScheme::kInvalid;
+        uint32_t num_threads_ = 1;
+        uint32_t num_samples_ = 256;
+        std::string order_file_;
+        uint32_t tree_width_ = 0;
+        bool fold_graph_ = false;
 };
 
+// merge-intersection kernel of USPCQuery::Count over the split layout of
+// FlatLabel: sorted hub ranks h1/h2 with their entries e1/e2
+using CountKernel = std::pair<uint32_t, uint64_t> (*)(
+    const uint32_t* h1, const LabelEntry* e1, size_t n1,
+    const uint32_t* h2, const LabelEntry* e2, size_t n2);
+
 class USPCQuery final: private USPC {
     public:
+        enum class KernelScheme {
+            kAuto,
+            kScalar,
+            kAVX2,
+            kAVX512
+        };
+
         USPCQuery() = default;
         USPCQuery(const USPCQuery&) = delete;
         USPCQuery& operator=(const USPCQuery&) = delete;
+        ~USPCQuery();
 
         std::pair<uint32_t, uint64_t> Count(uint32_t v1, uint32_t v2) const;
+        // results[i] = Count(queries[i]); the rank, offset and label loads of
+        // the following queries are prefetched while query i is merged
+        void CountBatch(const std::pair<uint32_t, uint32_t>* queries, size_t num,
+                        std::pair<uint32_t, uint64_t>* results) const;
         std::pair<uint32_t, uint64_t> bi_BFS_Count(Graph& graph, uint32_t v1, uint32_t v2);
+        // thread-safe as long as each thread passes its own workspace,
+        // initialized for graph.size() vertices
+        std::pair<uint32_t, uint64_t> bi_BFS_Count(const Graph& graph, uint32_t v1, uint32_t v2,
+                                                   BiBFSWorkspace& ws) const;
 
         void IndexRead(const std::string& filename);
         void IndexRead_UPD(const std::string& filename);
+        // map a query-ready index and answer from it in place
+        void IndexMap(const std::string& filename);
+        bool IndexVerify() const;
+        // re-encode the labels as a CompressedLabel, which Count then decodes
+        // on the fly, and free the flat ones; flat indexes only
+        void Compress();
+        bool compressed() const { return nullptr != zv_.bytes; }
+        // bytes of the label store Count reads (offsets and labels)
+        uint64_t label_bytes() const;
         void UpdateGraph(Graph& graph, uint32_t v1, uint32_t v2, char upd_type);
         void print_Label(uint32_t v);
 
+        // a kernel the cpu cannot run falls back to scalar (avx512 does not
+        // fall back to avx2)
+        void set_kernel(const KernelScheme ks);
+        const char* kernel_name() const { return kernel_name_; }
+
+    private:
+        uint64_t ReadOrder(FILE* file);
+        // Count when a vertex (by rank) is a core-tree tree vertex
+        std::pair<uint32_t, uint64_t> CountTree(uint32_t r1, uint32_t r2) const;
+        // Count on a folded index, by rank
+        std::pair<uint32_t, uint64_t> CountFold(uint32_t r1, uint32_t r2) const;
+        void SetFold(const FoldEntry* fold);
+        uint32_t Ancestor(uint32_t r, uint32_t depth) const;
+        // Count over zv_, by rank
+        std::pair<uint32_t, uint64_t> CountCompressed(uint32_t r1, uint32_t r2) const;
+
+        FlatLabel fL_; // merged labels, replaces cL_ on the query side
+
+        // what Count reads: fL_ and rank_/order_, or the mapped file
+        FlatLabelView lv_;
+        const uint32_t* qrank_ = nullptr;
+        const uint32_t* qorder_ = nullptr;
+        const FoldEntry* qfold_ = nullptr; // fold_ or the mapped one, if folded
+        // by rank, a skew-binary jump pointer towards the root for the LCA
+        // walk of CountFold (SetFold); the vertex itself in the kernel
+        std::vector<uint32_t> jump_;
+        bool twins_ = false; // some representative has twins
+        CompressedLabel zL_; // Compress on loaded labels
+        CompressedLabelView zv_; // zL_ or the mapped one, if compressed
+
+        void* map_ = nullptr;
+        size_t map_bytes_ = 0;
+
+        BiBFSWorkspace bws_; // bi_BFS_Count without a workspace of its own
+
+        CountKernel kernel_ = nullptr;
+        const char* kernel_name_ = "none";
+
+};
+
+// labels of USPCUpdate as published for lock-free readers. Vertices are
+// reached by id through fixed-size pages of label pointers, so a new
+// snapshot copies only the pages and labels of vertices changed since the
+// last one and shares everything else with it, and readers need no rank
+// array. Labels are stored without gaps.
+struct LabelSnapshot {
+    static constexpr uint32_t kPageBits = 10;
+    using Page = std::vector<const std::vector<LabelEntry>*>;
+
+    std::vector<Page*> pages;
+
+    const std::vector<LabelEntry>& operator[](const uint32_t v) const {
+        return *(*pages[v >> kPageBits])[v & ((1u << kPageBits) - 1)];
+    }
 };
 
 class USPCUpdate final: private USPC {
@@ -104,37 +395,200 @@ class USPCUpdate final: private USPC {
         USPCUpdate() = default;
         USPCUpdate(const USPCUpdate&) = delete;
         USPCUpdate& operator=(const USPCUpdate&) = delete;
+        ~USPCUpdate();
 
         void IndexRead(const std::string& filename);
         uint64_t IndexWrite(const std::string& filename);
+        uint64_t QueryIndexWrite(const std::string& filename) const;
 
         std::pair<uint32_t, uint64_t> Count(uint32_t v1, uint32_t v2) const;
+        // by vertex id rather than rank
+        std::pair<uint32_t, uint64_t> CountID(uint32_t v1, uint32_t v2) const {
+            return Count(rank_[v1], rank_[v2]);
+        }
+        bool HasEdge(uint32_t v1, uint32_t v2) const;
+        // the top-ranked vertex of the component of v (by id): it is the
+        // first hub of every label in the component, so updates keep it
+        uint32_t Component(uint32_t v) const { return order_[LEExtractV(cL_[rank_[v]][0])]; }
+        uint32_t num_vertices() const { return n_; }
+        // threads that run the hub BFSs of Inc_SPC, Dec_SPC and their batches
+        void set_threads(const int threads) { threads_ = std::max(1, threads); }
+
+        // inverted labels: once EnableInverted has run, the vertices whose
+        // labels hold each hub are kept up to date, and Update_hub removes
+        // stale entries through them instead of scanning the affected labels
+        void EnableInverted();
+        bool inverted() const { return inverted_; }
+        // vertex ids whose labels hold vertex id v as a hub, v included
+        std::vector<uint32_t> CoveredID(uint32_t v) const;
+
+        // snapshot-isolated reads (RCU with epochs): once EnableSnapshots has
+        // run, reader threads may call SnapshotCount, each with its own slot
+        // from AddReader, while one writer applies Inc_SPC/Dec_SPC. Readers
+        // never block and see the labels as of the writer's last Publish;
+        // replaced labels are freed when no reader can still hold them.
+        void EnableSnapshots();
+        void Publish();
+        // a free reader slot, or kNoReader once all kMaxReaders are taken
+        static constexpr uint32_t kMaxReaders = 256;
+        static constexpr uint32_t kNoReader = kMaxReaders;
+        uint32_t AddReader();
+        void RemoveReader(uint32_t reader);
+        std::pair<uint32_t, uint64_t> SnapshotCount(uint32_t reader, uint32_t v1, uint32_t v2) const;
 
         std::tuple<uint32_t, size_t, uint32_t, size_t, uint32_t, uint32_t, uint32_t> Inc_SPC(uint32_t a, uint32_t b);
         std::tuple<uint32_t, uint32_t, uint32_t> Inc_BFS(uint32_t hub, uint32_t ab, uint32_t d, uint64_t c);
+        // insert several edges (vertex ids) at once: every hub affected by any
+        // of them is resumed once, in rank order, from all of its seeds
+        std::tuple<uint32_t, uint32_t, uint32_t> Inc_SPC_Batch(const std::vector<std::pair<uint32_t, uint32_t>>& edges);
 
         std::tuple<uint32_t,uint32_t,size_t,size_t,size_t,size_t,uint32_t,uint32_t,uint32_t,uint32_t> Dec_SPC(uint32_t a, uint32_t b);
         std::tuple<uint32_t, uint32_t, uint32_t, uint32_t> Update_hub(uint32_t hub, 
             const std::vector<int>& Aff_list, const std::vector<uint32_t>& Affs,
             const std::vector<uint32_t>& Recs, int is_hub);
+        // delete several edges (vertex ids) at once: the affected and receiver
+        // sets of all edges are found on the graph before the batch, and every
+        // vertex in their union is repaired once as a hub, in rank order
+        std::tuple<uint32_t, uint32_t, uint32_t, uint32_t, uint32_t> Dec_SPC_Batch(const std::vector<std::pair<uint32_t, uint32_t>>& edges);
         std::tuple<int, uint32_t, uint32_t, uint32_t, uint32_t> Fast_update(uint32_t a, uint32_t b, 
             const std::vector<int>& Aff_list, const std::vector<uint32_t>& AffA, const std::vector<uint32_t>& AffB,
-            const std::vector<uint32_t>& RecA, std::vector<uint32_t> RecB);
-        std::tuple<uint32_t, uint64_t, uint32_t, uint64_t, uint32_t> Query_Search(uint32_t h, uint32_t v);
-        uint32_t Query_Distance(uint32_t hub, uint32_t v);
+            const std::vector<uint32_t>& RecA, const std::vector<uint32_t>& RecB);
+        // vertex updates by id. A new vertex is isolated and takes the next id
+        // and the lowest rank, so no label is renumbered; AddVertex returns
+        // its id. RemoveVertex deletes the edges of v in one decremental step
+        // and leaves v isolated, keeping its id; it returns affected,
+        // renew_C, renew_D, insert, remove
+        uint32_t AddVertex();
+        std::tuple<uint32_t, uint32_t, uint32_t, uint32_t, uint32_t> RemoveVertex(uint32_t v);
+
+        std::tuple<uint32_t, uint64_t, uint32_t, uint64_t, uint32_t> Query_Search(uint32_t h, uint32_t v) const;
+        uint32_t Query_Distance(uint32_t hub, uint32_t v) const;
 
     private:
+        // turn the tree labels of a core-tree index (merged, by rank) into
+        // the flat labels the updates maintain
+        void ExpandTree(Label& L) const;
+        // the same for a folded index
+        void ExpandFold(Label& L) const;
+
+        // start of a resumed BFS: vertex v is reached from the hub at
+        // distance d by c paths that cross a new edge
+        struct IncSeed {
+            uint32_t hub, v, d;
+            uint64_t c;
+        };
+        // seeds of one hub, sorted by d
+        std::tuple<uint32_t, uint32_t, uint32_t> Inc_BFS(const IncSeed* seeds, size_t num);
+
+        // one Update_hub call: the hub, the vertices it may write (flagged in
+        // Aff_list) and those that may lose it (Affs and Recs if is_hub)
+        struct HubJob {
+            uint32_t hub;
+            const std::vector<int>* Aff_list;
+            const std::vector<uint32_t>* Affs;
+            const std::vector<uint32_t>* Recs;
+            int is_hub;
+        };
+        // label changes found by the search of one hub, applied afterwards
+        struct HubRepair {
+            std::vector<std::pair<uint32_t, LabelEntry>> writes; // insert or set
+            std::vector<uint32_t> erases;
+            uint32_t renew_C, renew_D, insert, remove;
+        };
+        // searches read cL_ only, so searches of independent hubs may overlap
+        void Search_hub(const HubJob& job, BFSWorkspace& ws, FlagWorkspace& updated,
+            std::vector<uint32_t>& hash_dist, HubRepair& rep) const;
+        void Search_inc(const IncSeed* seeds, size_t num, BFSWorkspace& ws,
+            std::vector<uint32_t>& hash_dist, HubRepair& rep) const;
+        void Apply_hub(uint32_t hub, const HubRepair& rep);
+        // Update_hub for every job, in hub order
+        std::tuple<uint32_t, uint32_t, uint32_t, uint32_t> Repair_hubs(const std::vector<HubJob>& jobs);
+        // Inc_BFS for every group [first, second) of seeds, in hub order
+        std::tuple<uint32_t, uint32_t, uint32_t> Inc_hubs(const std::vector<IncSeed>& seeds,
+            const std::vector<std::pair<size_t, size_t>>& groups);
+        // num jobs on threads_ threads; search(k, t, rep) runs job k with the
+        // workspaces of thread t, or the members for t < 0. See u_spc.cc
+        std::tuple<uint32_t, uint32_t, uint32_t, uint32_t> Run_waves(size_t num,
+            const std::function<uint32_t(size_t)>& hub_of,
+            const std::function<void(size_t, int, HubRepair&)>& search);
+
+        // whether edge (a, b) is a bridge, by two searches that stop when they
+        // meet; see u_spc.cc. Cut_bridge takes the side the search exhausted
+        int Bridge_side(uint32_t a, uint32_t b, std::vector<uint32_t> (&Q)[2]);
+        uint32_t Cut_bridge(uint32_t a, uint32_t b, const std::vector<uint32_t>& S, int s);
+
+        // add to Aff every unflagged vertex u with d(u, t) = d(u, s) + 1,
+        // i.e. whose shortest paths to t may cross edge (s, t); flags aff_a_
+        void Dec_Search(uint32_t s, uint32_t t, std::vector<uint32_t>& Aff);
+
+        // probes of a label against a dense one (distances, counts by hub)
+        void LoadDense(uint32_t v);
+        void UnloadDense(uint32_t v);
+        std::pair<uint32_t, uint64_t> ProbeCount(const std::vector<uint32_t>& dLu,
+                        const std::vector<uint64_t>& cLu, const GappedLabel& dLv) const;
+        std::tuple<uint32_t, uint32_t, uint64_t, size_t> Probe(const std::vector<uint32_t>& dLu,
+                        const GappedLabel& dLv, uint32_t hub) const;
+
         std::pair<uint32_t, size_t> Distance(const std::vector<uint32_t>& dLu,
-                        const std::vector<LabelEntry>& dLv, uint32_t hub) const;
+                        const GappedLabel& dLv, uint32_t hub) const;
 
         std::pair<uint32_t, uint32_t> FastDistanceCount(const std::vector<std::pair<uint32_t, uint32_t>>& dLu,
-                        const std::vector<LabelEntry>& dLv) const;
+                        const GappedLabel& dLv) const;
 
         uint32_t FastDistance(const std::vector<uint32_t>& dLu,
-                        const std::vector<LabelEntry>& dLv) const;
+                        const GappedLabel& dLv) const;
 
         std::pair<uint32_t, uint64_t> BFS_SPC(const Graph& const_graph, uint32_t s, uint32_t t);
 
+        std::vector<GappedLabel> cL_; // merged labels
+
+        // reusable workspaces, sized once in IndexRead
+        BFSWorkspace ws_;                   // Inc_BFS, Update_hub, affected search
+        std::vector<uint32_t> hash_dist_;   // dense label of the current hub
+        std::vector<uint64_t> hash_count_;  // its counts, where Dec_SPC needs them
+        FlagWorkspace hub_a_, hub_b_;       // hubs of a and b in Dec_SPC
+        FlagWorkspace aff_a_, aff_b_;       // affected/receiver flags by rank
+        FlagWorkspace updated_;             // vertices renewed by Update_hub
+        HubRepair repair_;                  // changes of the running Update_hub
+
+        // inverted labels, by rank; unordered
+        void InvAdd(const uint32_t hub, const uint32_t v) { if (inverted_) inv_[hub].push_back(v); }
+        void InvRemove(uint32_t hub, uint32_t v);
+
+        bool inverted_ = false;
+        std::vector<std::vector<uint32_t>> inv_;
+
+        // parallel hub BFSs
+        int threads_ = 1;
+        std::vector<BFSWorkspace> tws_;     // per thread
+        std::vector<FlagWorkspace> tupdated_;
+        std::vector<std::vector<uint32_t>> thash_dist_;
+        std::vector<HubRepair> trepair_;    // per hub of a wave
+        FlagWorkspace wave_;                // hubs of the running wave
+        FlagWorkspace written_;             // labels changed during the wave
+
+        // snapshots
+        struct alignas(64) ReaderSlot {
+            std::atomic<uint64_t> epoch{0}; // 0 while the reader is idle
+            std::atomic<bool> used{false};
+        };
+        struct Retired {
+            uint64_t epoch;
+            const LabelSnapshot* root;
+            std::vector<LabelSnapshot::Page*> pages;
+            std::vector<const std::vector<LabelEntry>*> labels;
+        };
+
+        void Dirty(const uint32_t v) { if (snapshots_) dirty_.Set(v, 1); }
+        void Reclaim();
+
+        bool snapshots_ = false;
+        FlagWorkspace dirty_;               // labels changed since Publish
+        std::atomic<const LabelSnapshot*> snap_{nullptr};
+        std::atomic<uint64_t> epoch_{1};
+        std::unique_ptr<ReaderSlot[]> readers_;
+        std::vector<Retired> retired_;
+
 };
 
 }
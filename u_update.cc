@@ -1,4 +1,5 @@
 #include <unistd.h>
+#include <algorithm>
 #include <chrono>
 #include <cinttypes>
 #include <cstdint>
@@ -30,8 +31,11 @@ int main(int argc, char** argv) {
     std::string ufilename; // udate edges
     std::string ifilename; // info file
     std::string newlfilename; // updated index file
+    char batch = 'n'; // consecutive insertions (deletions) as one Inc_SPC_Batch (Dec_SPC_Batch)
+    int threads = 1; // threads for the hub BFSs of an update
+    char inverted = 'n'; // keep the hub -> vertices index
     int option = -1;
-    while (-1 != (option = getopt(argc, argv, "l:n:u:i:"))) {
+    while (-1 != (option = getopt(argc, argv, "l:n:u:i:b:p:v:"))) {
         switch (option) {
             case 'l':
             lfilename = optarg; break;
@@ -41,12 +45,19 @@ int main(int argc, char** argv) {
             ufilename = optarg; break;
             case 'i':
             ifilename = optarg; break;
+            case 'b':
+            batch = optarg[0]; break;
+            case 'p':
+            threads = std::max(1, atoi(optarg)); break;
+            case 'v':
+            inverted = optarg[0]; break;
         }
     }
     
     printf("ori label file: %s\n", lfilename.c_str());
     printf("new label file: %s\n", newlfilename.c_str());
     printf("update file: %s\n", ufilename.c_str());
+    printf("threads: %d\n", threads);
 
     // read index
     spc::USPCUpdate uspu;
@@ -55,9 +66,16 @@ int main(int argc, char** argv) {
     FILE* file_u = fopen(ufilename.c_str(), "r");
 
     uint32_t num_update = 0;
-    // std::vector<std::tuple<uint32_t, uint32_t, char>> upd_edges;
+    std::vector<std::tuple<uint32_t, uint32_t, char>> upd_edges;
 
     fscanf(file_u, "%" SCNu32, &num_update);
+    for (uint32_t u = 0; u < num_update; ++u) {
+        uint32_t v1, v2;
+        char upd_type;
+        fscanf(file_u, "%" SCNu32 " %" SCNu32 " %c", &v1, &v2, &upd_type);
+        upd_edges.push_back(std::make_tuple(v1, v2, upd_type));
+    }
+    fclose(file_u);
     
     // Write info title
     std::ofstream ifile;
@@ -66,6 +84,8 @@ int main(int argc, char** argv) {
 
     // read index
     uspu.IndexRead(lfilename);
+    uspu.set_threads(threads);
+    if (inverted == 'y') uspu.EnableInverted();
 
     auto during = std::chrono::steady_clock::now() - std::chrono::steady_clock::now();
 
@@ -82,11 +102,55 @@ int main(int argc, char** argv) {
 
         uint32_t v1, v2;
         char upd_type;
+        std::tie(v1, v2, upd_type) = upd_edges[i];
 
-        fscanf(file_u, "%" SCNu32 " %" SCNu32 " %c", &v1, &v2, &upd_type);
+        // a run of insertions or deletions
+        int j = i + 1;
+        while (batch == 'y' && j < num_update && std::get<2>(upd_edges[j]) == upd_type) ++j;
+
+        std::vector<std::pair<uint32_t, uint32_t>> block;
+        for (int k = i; k < j; ++k) {
+            block.push_back(std::make_pair(std::get<0>(upd_edges[k]), std::get<1>(upd_edges[k])));
+        }
+
+        if (upd_type == 'i' && j - i > 1) {
+
+            for (int k = i + 1; k < j; ++k) bar.update();
+
+            const auto beg = std::chrono::steady_clock::now();
+            auto inc_info = uspu.Inc_SPC_Batch(block); // batch inc update
+            const auto end = std::chrono::steady_clock::now();
+            const auto dif = end - beg;
+
+            // write batch size + info + update time into info file
+            ifile << "batch" << std::setw(12) << block.size() << std::setw(12)
+            << std::get<0>(inc_info) << std::setw(12) << std::get<1>(inc_info) << std::setw(12) 
+            << std::get<2>(inc_info) << std::setw(12) 
+            << std::chrono::duration<double, std::milli>(dif).count() << std::setw(12) << "\n";
 
+            during += dif;
+            i = j - 1;
+
+        } else if (upd_type == 'd' && j - i > 1) {
+
+            for (int k = i + 1; k < j; ++k) bar.update();
 
-        if (upd_type == 'i') {
+            const auto beg = std::chrono::steady_clock::now();
+            auto dec_info = uspu.Dec_SPC_Batch(block); // batch dec update
+            const auto end = std::chrono::steady_clock::now();
+            const auto dif = end - beg;
+
+            // write batch size + affected + renew + insert/remove + update time into info file
+            ifile << "batch" << std::setw(12) << block.size() << std::setw(12)
+            << std::get<0>(dec_info) << std::setw(12)
+            << std::get<1>(dec_info) << std::setw(12) << std::get<2>(dec_info) << std::setw(12)
+            << std::get<3>(dec_info) << std::setw(12) << std::get<4>(dec_info) << std::setw(12)
+            << std::chrono::duration<double, std::milli>(dif).count() << "\n";
+
+            during += dif;
+            i = j - 1;
+
+        } else if (upd_type == 'i') {
             
             const auto beg = std::chrono::steady_clock::now();
             auto inc_info = uspu.Inc_SPC(v1, v2); // inc update
@@ -121,6 +185,34 @@ int main(int argc, char** argv) {
             << std::chrono::duration<double, std::milli>(dif).count() << "\n"; // time
             during += dif;
 
+        } else if (upd_type == 'a') {
+
+            // vertex insertion, v1 is the id it gets
+            const auto beg = std::chrono::steady_clock::now();
+            const uint32_t v = uspu.AddVertex();
+            const auto end = std::chrono::steady_clock::now();
+            const auto dif = end - beg;
+            ASSERT_INFO(v == v1, "new vertices take the next id");
+
+            ifile << "add" << std::setw(12) << v << std::setw(12)
+            << std::chrono::duration<double, std::milli>(dif).count() << "\n";
+            during += dif;
+
+        } else if (upd_type == 'r') {
+
+            // vertex deletion: all edges of v1 in one step
+            const auto beg = std::chrono::steady_clock::now();
+            auto dec_info = uspu.RemoveVertex(v1);
+            const auto end = std::chrono::steady_clock::now();
+            const auto dif = end - beg;
+
+            ifile << "remove" << std::setw(12) << v1 << std::setw(12)
+            << std::get<0>(dec_info) << std::setw(12)
+            << std::get<1>(dec_info) << std::setw(12) << std::get<2>(dec_info) << std::setw(12)
+            << std::get<3>(dec_info) << std::setw(12) << std::get<4>(dec_info) << std::setw(12)
+            << std::chrono::duration<double, std::milli>(dif).count() << "\n";
+            during += dif;
+
         }
     }
 
@@ -128,6 +220,7 @@ int main(int argc, char** argv) {
     const auto dif_mp = end_mp - beg_mp;
     std::cout << std::endl;
     auto label_num = uspu.IndexWrite(newlfilename);
+    uspu.QueryIndexWrite(newlfilename + ".q");
 
     // write average update time into info file
     ifile << "Average: " << std::chrono::duration<double, std::milli>(during).count()/num_update << "\n";